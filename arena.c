@@ -0,0 +1,215 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include "dufus.h"
+
+/*
+ * Scan trees live in arenas. Nodes are carved from slabs of
+ * NODESLAB nodes and children arrays are bump-allocated from byte
+ * chunks, so allocation during a scan is a pointer increment and
+ * dropping a tree frees a handful of chunks instead of every node.
+ *
+ * An arena is only ever allocated from by one proc. A parallel scan
+ * gives each worker its own arena and links it to the tree's arena,
+ * so freeing the tree's arena releases everything the scan made.
+ */
+
+enum {
+	NODESLAB = 4096,       /* Nodes per slab */
+	BYTECHUNK = 256*1024   /* Bytes per chunk for children arrays */
+};
+
+typedef struct Chunk Chunk;
+
+struct Chunk {
+	Chunk *next;
+	ulong size;            /* Bytes, including this header */
+	uvlong pad;            /* Keep what follows 8-byte aligned */
+};
+
+struct Arena {
+	Lock;                  /* Protects sub */
+	Arena *sub;            /* Arenas of scanner procs working on this tree */
+	Arena *next;           /* Next in the parent's sub list */
+	Chunk *chunks;
+
+	FsNode *slab;          /* Unused part of the current node slab */
+	int slableft;
+	uchar *bump;           /* Unused part of the current byte chunk */
+	ulong bumpleft;
+
+	/* Statistics */
+	long nodes;
+	vlong childbytes;
+	vlong wastebytes;      /* Children arrays abandoned by growth */
+	long nchunks;
+	vlong chunkbytes;
+};
+
+/* Allocate a new chunk with n usable bytes */
+static void*
+newchunk(Arena *a, ulong n)
+{
+	Chunk *c;
+
+	c = malloc(sizeof(Chunk) + n);
+	if(c == nil)
+		sysfatal("malloc failed: %r");
+
+	c->size = sizeof(Chunk) + n;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->nchunks++;
+	a->chunkbytes += c->size;
+
+	return c + 1;
+}
+
+/* Create an empty arena */
+Arena*
+newarena(void)
+{
+	Arena *a;
+
+	a = mallocz(sizeof(Arena), 1);
+	if(a == nil)
+		sysfatal("malloc failed: %r");
+
+	return a;
+}
+
+/* Create an arena for another proc to fill, released with parent */
+Arena*
+subarena(Arena *parent)
+{
+	Arena *a;
+
+	a = newarena();
+	lock(parent);
+	a->next = parent->sub;
+	parent->sub = a;
+	unlock(parent);
+
+	return a;
+}
+
+/* Release an arena, its sub-arenas and everything allocated from them */
+void
+freearena(Arena *a)
+{
+	Arena *s, *snext;
+	Chunk *c, *cnext;
+
+	if(a == nil)
+		return;
+
+	for(s = a->sub; s != nil; s = snext) {
+		snext = s->next;
+		freearena(s);
+	}
+
+	for(c = a->chunks; c != nil; c = cnext) {
+		cnext = c->next;
+		free(c);
+	}
+
+	free(a);
+}
+
+/* Allocate a zeroed node */
+FsNode*
+arenanode(Arena *a)
+{
+	FsNode *node;
+
+	if(a->slableft == 0) {
+		a->slab = newchunk(a, NODESLAB * sizeof(FsNode));
+		a->slableft = NODESLAB;
+	}
+
+	node = a->slab++;
+	a->slableft--;
+	a->nodes++;
+
+	memset(node, 0, sizeof(FsNode));
+	return node;
+}
+
+/* Allocate n bytes, 8-byte aligned */
+void*
+arenaalloc(Arena *a, ulong n)
+{
+	void *v;
+
+	n = (n + 7) & ~7;
+	if(n == 0)
+		return nil;
+
+	/* Big requests get a chunk to themselves */
+	if(n > BYTECHUNK / 4)
+		return newchunk(a, n);
+
+	if(n > a->bumpleft) {
+		a->bump = newchunk(a, BYTECHUNK);
+		a->bumpleft = BYTECHUNK;
+	}
+
+	v = a->bump;
+	a->bump += n;
+	a->bumpleft -= n;
+
+	return v;
+}
+
+/* Give a directory room for exactly n children */
+void
+arenachildren(Arena *a, FsNode *parent, int n)
+{
+	FsNode **children;
+
+	if(n <= parent->maxchildren)
+		return;
+
+	children = arenaalloc(a, n * sizeof(FsNode*));
+	if(parent->nchildren > 0)
+		memmove(children, parent->children, parent->nchildren * sizeof(FsNode*));
+
+	a->wastebytes += parent->maxchildren * sizeof(FsNode*);
+	a->childbytes += (n - parent->maxchildren) * sizeof(FsNode*);
+
+	parent->children = children;
+	parent->maxchildren = n;
+}
+
+static void
+addarenastats(Arena *a, TreeStats *ts)
+{
+	Arena *s;
+
+	ts->nodes += a->nodes;
+	ts->nodebytes += a->nodes * sizeof(FsNode);
+	ts->childbytes += a->childbytes;
+	ts->wastebytes += a->wastebytes;
+	ts->chunks += a->nchunks;
+	ts->chunkbytes += a->chunkbytes;
+
+	for(s = a->sub; s != nil; s = s->next)
+		addarenastats(s, ts);
+}
+
+/* Report the memory held by a tree's arena */
+void
+arenastats(Arena *a, TreeStats *ts)
+{
+	long hits;
+
+	memset(ts, 0, sizeof(*ts));
+	internstats(&ts->names, &hits, &ts->namebytes);
+	if(a == nil)
+		return;
+
+	lock(a);
+	addarenastats(a, ts);
+	unlock(a);
+}
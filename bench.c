@@ -0,0 +1,380 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <memdraw.h>
+#include <pool.h>
+#include <thread.h>
+#include "dufus.h"
+
+/*
+ * Benchmarks, run by -B and by mk bench. Apart from scanning the
+ * directory it is given, they run on trees made up by synth.c from a
+ * fixed seed, so that runs are comparable from commit to commit:
+ *
+ *	wide		one directory of files
+ *	deep		a chain of directories, each holding files
+ *	sierpinski	three subdirectories and two files at every level
+ *			and three files at the bottom
+ *
+ * Each benchmark is repeated until it has run for BENCH_TIME and the
+ * fastest run is reported, per node (or tile, point or frame) and
+ * per second, with the memory it used: the tree it worked on, from
+ * its arena, which only grows, and the most any run left allocated
+ * besides, such as tiles and cached labels.
+ *
+ * Without a display, labels are fitted to the default subfont, and
+ * drawing is not timed. In its place memdraw fills, borders and
+ * labels the treemap's tiles in a memimage: a baseline for the pixels
+ * of a frame, which does not run draw_node and so shows nothing of
+ * its cost.
+ */
+
+enum {
+	BENCH_TIME = 500,          /* Milliseconds each benchmark runs for */
+	BENCH_MINRUNS = 3,
+	BENCH_SEED = 1,
+	NHITS = 100000,            /* Points looked up per hit-test run */
+	MAPW = 1024,               /* Size of the treemap laid out */
+	MAPH = 768
+};
+
+typedef struct Shape Shape;
+struct Shape {
+	char *name;
+	FsNode *root;
+	long nnodes;
+	Arena *arena;
+};
+
+static ulong rndstate;
+static vlong held;         /* Most a run of the last benchmark left allocated */
+static Font *benchfont;
+
+/* Drawing without a display */
+static Memimage *memdst;
+static Memimage *memback, *memfile, *memborder, *memtext;
+static Memimage *memdepth[8];
+static Memsubfont *memfont;
+static Font memfontwidths;     /* Stands for memfont in text.c */
+
+static ulong
+rnd(void)
+{
+	rndstate = rndstate * 1103515245 + 12345;
+	return rndstate >> 8;
+}
+
+/* Make the tree for spec, as synthsource takes it */
+static void
+mkshape(Shape *sh, char *spec)
+{
+	Source *old;
+	TreeStats ts;
+	Arena *a;
+
+	old = scansource;
+	scansource = synthsource(spec);
+	if(scansource == nil)
+		sysfatal("synthsource: %r");
+	sh->name = scansource->name;
+	a = newarena();
+	sh->root = create_fsnode(a, "/", 0, 1, nil);
+	scan_directory(a, "/", sh->root);
+	arenastats(a, &ts);
+	sh->nnodes = ts.nodes;
+	sh->arena = a;
+	scansource = old;
+}
+
+/* One line of results: n nodes, tiles, points or frames of the tree
+ * in a took ns nanoseconds */
+static void
+report(char *bench, char *shape, long n, char *units, vlong ns, Arena *a)
+{
+	TreeStats ts;
+	char tree[32];
+
+	arenastats(a, &ts);
+	snprint(tree, sizeof(tree), "%s", format_size(ts.chunkbytes + ts.namebytes));
+	print("%-8s %-10s %8ld %-6s %12.1f ns each %12.0f/s  tree %s held %s\n",
+		bench, shape, n, units, (double)ns / n, n * 1e9 / ns,
+		tree, format_size(held > 0 ? held : 0));
+}
+
+/* Put every directory's children out of order again */
+static void
+shuffle(FsNode *node)
+{
+	FsNode *x;
+	int i, j;
+
+	node->nsorted = 0;
+	for(i = node->nchildren - 1; i > 0; i--) {
+		j = rnd() % (i + 1);
+		x = node->children[i];
+		node->children[i] = node->children[j];
+		node->children[j] = x;
+	}
+	for(i = 0; i < node->nchildren; i++)
+		if(node->children[i]->nchildren > 0)
+			shuffle(node->children[i]);
+}
+
+static void
+sortall(FsNode *node)
+{
+	int i;
+
+	sort_nodes_by_size(node);
+	for(i = 0; i < node->nchildren; i++)
+		if(node->children[i]->nchildren > 0)
+			sortall(node->children[i]);
+}
+
+static void
+truncall(FsNode *node, char *buf)
+{
+	int i;
+
+	for(i = 0; i < node->nchildren; i++) {
+		strcpy(buf, node->children[i]->name);
+		truncate_string(buf, benchfont, 40);
+		if(node->children[i]->nchildren > 0)
+			truncall(node->children[i], buf);
+	}
+}
+
+static Memimage*
+memcolor(ulong rgba)
+{
+	Memimage *m;
+
+	m = allocmemimage(Rect(0, 0, 1, 1), RGB24);
+	if(m == nil)
+		sysfatal("allocmemimage: %r");
+	m->flags |= Frepl;
+	m->clipr = Rect(-0x3FFFFFF, -0x3FFFFFF, 0x3FFFFFF, 0x3FFFFFF);
+	memfillcolor(m, rgba);
+	return m;
+}
+
+/* Get ready to draw without a display, in the colours of init_colors */
+static void
+meminit(void)
+{
+	static ulong depth[8] = {
+		0x4B0082FF, 0x0000CDFF, 0x1E90FFFF, 0x00CED1FF,
+		0x00FF7FFF, 0xFFFF00FF, 0xFF7F00FF, 0xFF0000FF
+	};
+	int i;
+
+	memimageinit();
+	memfont = getmemdefont();
+	if(memfont == nil)
+		sysfatal("getmemdefont: %r");
+	memfontwidths.height = memfont->height;
+	memfontwidths.ascent = memfont->ascent;
+	subfontwidths(&memfontwidths, memfont->info, memfont->n);
+	memdst = allocmemimage(Rect(0, 0, MAPW, MAPH), XRGB32);
+	if(memdst == nil)
+		sysfatal("allocmemimage: %r");
+	memback = memcolor(0x1a1a1aFF);
+	memfile = memcolor(0x87CEEBFF);
+	memborder = memcolor(0x555555FF);
+	memtext = memcolor(0xE0E0E0FF);
+	for(i = 0; i < nelem(depth); i++)
+		memdepth[i] = memcolor(depth[i]);
+}
+
+static void
+memfree(void)
+{
+	int i;
+
+	freememimage(memdst);
+	freememimage(memback);
+	freememimage(memfile);
+	freememimage(memborder);
+	freememimage(memtext);
+	for(i = 0; i < nelem(memdepth); i++)
+		freememimage(memdepth[i]);
+}
+
+static void
+membox(Rectangle r, int w, Memimage *src)
+{
+	memimagedraw(memdst, Rect(r.min.x, r.min.y, r.max.x, r.min.y + w), src, ZP, memopaque, ZP, SoverD);
+	memimagedraw(memdst, Rect(r.min.x, r.max.y - w, r.max.x, r.max.y), src, ZP, memopaque, ZP, SoverD);
+	memimagedraw(memdst, Rect(r.min.x, r.min.y + w, r.min.x + w, r.max.y - w), src, ZP, memopaque, ZP, SoverD);
+	memimagedraw(memdst, Rect(r.max.x - w, r.min.y + w, r.max.x, r.max.y - w), src, ZP, memopaque, ZP, SoverD);
+}
+
+/* Draw t into memdst: a fill, a border, its name and size. This is
+ * not draw_node and only roughly what it puts on the screen. */
+static void
+memtile(Tile *t)
+{
+	Rectangle r;
+	FsNode *node, *parent;
+	Memimage *fill;
+	char size[32];
+	int depth, b, w, y;
+
+	node = t->node;
+	r = t->r;
+	if(Dx(r) <= 0 || Dy(r) <= 0)
+		return;
+
+	depth = 0;
+	for(parent = node->parent; parent != nil && depth < MAX_DEPTH_LEVEL - 1; parent = parent->parent)
+		depth++;
+	if(t->nrest > 0)
+		fill = memback;
+	else if(node->isdir)
+		fill = memdepth[depth % 8];
+	else
+		fill = memfile;
+	b = node->isdir && t->nrest == 0 ? 2 : 1;
+	memimagedraw(memdst, r, fill, ZP, memopaque, ZP, SoverD);
+	membox(r, b, memborder);
+
+	w = Dx(r) - 2*(b + 3);
+	if(t->nrest > 0 || w <= 0 || Dx(r) <= LABEL_THRESHOLD || Dy(r) <= LABEL_THRESHOLD)
+		return;
+	y = r.min.y + b + 3;
+	if(y + memfont->height > r.max.y - 3)
+		return;
+	memimagestring(memdst, Pt(r.min.x + b + 3, y), memtext, ZP, memfont,
+		nodelabel(node, &memfontwidths, w));
+	y += memfont->height + 2;
+	snprint(size, sizeof(size), "%s", format_size(node->size));
+	truncate_string(size, &memfontwidths, w);
+	if(y + memfont->height <= r.max.y - 3)
+		memimagestring(memdst, Pt(r.min.x + b + 3, y), memtext, ZP, memfont, size);
+}
+
+/* Run the benchmark for sh until BENCH_TIME is up; returns the
+ * fastest run in nanoseconds */
+static vlong
+timeit(char *bench, Shape *sh)
+{
+	vlong t0, t, best, end;
+	uintptr start;
+	char buf[64];
+	int runs, i;
+
+	held = 0;
+	start = mainmem->curalloc;
+	best = -1;
+	end = nsec() + BENCH_TIME * 1000000LL;
+	for(runs = 0; runs < BENCH_MINRUNS || nsec() < end; runs++) {
+		rndstate = BENCH_SEED;
+		if(strcmp(bench, "sort") == 0)
+			shuffle(sh->root);
+
+		t0 = nsec();
+		if(strcmp(bench, "sort") == 0)
+			sortall(sh->root);
+		else if(strcmp(bench, "layout") == 0) {
+			treegen++;
+			layout_current(Rect(0, 0, MAPW, MAPH));
+		} else if(strcmp(bench, "hittest") == 0) {
+			for(i = 0; i < NHITS; i++)
+				find_tile_at_point(Pt(rnd() % MAPW, rnd() % MAPH));
+		} else if(strcmp(bench, "truncate") == 0)
+			truncall(sh->root, buf);
+		else if(strcmp(bench, "draw") == 0) {
+			treegen++;
+			draw_ui();
+		} else if(strcmp(bench, "memdraw") == 0) {
+			memimagedraw(memdst, memdst->r, memback, ZP, memopaque, ZP, SoverD);
+			for(i = 0; i < ntiles; i++)
+				memtile(&tiles[i]);
+		}
+		t = nsec() - t0;
+
+		if(best < 0 || t < best)
+			best = t;
+		if((vlong)(mainmem->curalloc - start) > held)
+			held = mainmem->curalloc - start;
+	}
+
+	return best;
+}
+
+/* Run every benchmark, scanning dir */
+void
+runbench(char *dir)
+{
+	static char *shapes[] = { "wide:100000", "deep:10000", "sierpinski:100000" };
+	Shape sh[nelem(shapes)];
+	TreeStats ts;
+	Arena *a;
+	FsNode *r;
+	uintptr start;
+	vlong t;
+	long n;
+	int i, havedisplay;
+
+	/* Scanning reads a real directory, once, as it would be cached
+	 * the second time. What it holds besides the tree is the memory
+	 * it took less the tree's. */
+	start = mainmem->curalloc;
+	a = newarena();
+	r = create_fsnode(a, dir, 0, 1, nil);
+	t = nsec();
+	scan_directory(a, dir, r);
+	t = nsec() - t;
+	arenastats(a, &ts);
+	held = (vlong)(mainmem->curalloc - start) - ts.chunkbytes - ts.namebytes;
+	report("scan", "dir", ts.nodes, "nodes", t, a);
+	freearena(a);
+
+	/* Scanning the made-up trees builds them, without the disk */
+	for(i = 0; i < nelem(shapes); i++) {
+		start = mainmem->curalloc;
+		t = nsec();
+		mkshape(&sh[i], shapes[i]);
+		t = nsec() - t;
+		arenastats(sh[i].arena, &ts);
+		held = (vlong)(mainmem->curalloc - start) - ts.chunkbytes - ts.namebytes;
+		report("scan", sh[i].name, sh[i].nnodes, "nodes", t, sh[i].arena);
+	}
+
+	for(i = 0; i < nelem(shapes); i++)
+		report("sort", sh[i].name, sh[i].nnodes, "nodes", timeit("sort", &sh[i]), sh[i].arena);
+
+	for(i = 0; i < nelem(shapes); i++) {
+		current = sh[i].root;
+		sortall(current);
+		n = layout_current(Rect(0, 0, MAPW, MAPH));
+		report("layout", sh[i].name, n, "tiles", timeit("layout", &sh[i]), sh[i].arena);
+		report("hittest", sh[i].name, NHITS, "points", timeit("hittest", &sh[i]), sh[i].arena);
+	}
+
+	havedisplay = initdraw(nil, nil, "dufus bench") >= 0;
+	if(havedisplay) {
+		calculate_layout();
+		init_colors();
+		benchfont = font;
+	} else {
+		print("no display: %r; draw not timed, memdraw is a baseline in memory\n");
+		meminit();
+		benchfont = &memfontwidths;
+	}
+	for(i = 0; i < nelem(shapes); i++) {
+		report("truncate", sh[i].name, sh[i].nnodes - 1, "nodes", timeit("truncate", &sh[i]), sh[i].arena);
+		current = root = sh[i].root;
+		if(havedisplay)
+			report("draw", sh[i].name, 1, "frames", timeit("draw", &sh[i]), sh[i].arena);
+		else {
+			layout_current(Rect(0, 0, MAPW, MAPH));
+			report("memdraw", sh[i].name, 1, "frames", timeit("memdraw", &sh[i]), sh[i].arena);
+		}
+	}
+	current = root = nil;
+	if(!havedisplay)
+		memfree();
+	for(i = 0; i < nelem(shapes); i++)
+		freearena(sh[i].arena);
+}
@@ -1,7 +1,7 @@
 #include <u.h>
 #include <libc.h>
 #include <draw.h>
-#include <event.h>
+#include <mouse.h>
 #include <keyboard.h>
 #include <thread.h>
 #include "dufus.h"
@@ -17,22 +17,29 @@ enum {
 	
 	/* Visualization parameters */
 	MINBOX = 20,           /* Minimum box size for rectangle in treemap */
-	
-	/* Text thresholds */
-	LABEL_THRESHOLD = 40,  /* Minimum size to show text labels */
+	GRIDCELL = 32,         /* Side of a cell of the treemap hit-test grid */
+	WHEEL_ROWS = 3,        /* List rows scrolled per wheel step */
 	
 	/* UI states */
 	NORMAL_STATE = 0,
 	HELP_STATE = 1,
+	TOP_STATE = 2,         /* Largest files and directories shown */
 	
 	/* Split ratio (percentage of height for treemap pane vs list pane) */
 	SPLIT_RATIO = 60,      /* Treemap now uses 60% of available space */
 	
 	/* Visualization parameters */
-	MAX_DEPTH_LEVEL = 8,   /* Maximum recursion depth to visualize differently */
 	FRACTAL_PADDING = 2    /* Spacing between elements */
 };
 
+/* Parts of the window to repaint */
+enum {
+	DLIST = 1<<0,
+	DTREEMAP = 1<<1,
+	DFOOTER = 1<<2,
+	DALL = DLIST|DTREEMAP|DFOOTER
+};
+
 /* Version string */
 char *VERSION = "0.2";
 
@@ -60,6 +67,9 @@ Rectangle footer_rect;    /* Footer rectangle */
 Rectangle list_rect;      /* List view rectangle (upper pane) */
 Rectangle treemap_rect;   /* Treemap visualization area (lower pane) */
 int ui_state = NORMAL_STATE;
+int show_stats = 0;       /* Stats overlay shown */
+Rectangle statsr;         /* Where it was last drawn, if not since drawn over */
+int exit_stats = 0;       /* Stats printed on exit (-S) */
 char status_message[256] = "Ready";
 char current_path[1024] = ".";
 char *argv0;
@@ -70,9 +80,59 @@ int selected_list_idx = -1; /* Selected item in list view */
 /* FS data state */
 FsNode *root = nil;       /* Root of file system tree */
 FsNode *current = nil;    /* Current navigation point */
+Arena *tree = nil;        /* Where root and everything below it live */
+Snap *snap = nil;         /* Snapshot the tree was read from, if any */
+
+/* Treemap layout of the current directory. It is kept until the
+ * directory, its rectangle or the tree changes; anything that changes
+ * sizes or structure bumps treegen. */
+Tile *tiles = nil;
+int ntiles = 0;
+int maxtiles = 0;
+FsNode *layout_node = nil;
+Rectangle layout_rect;
+ulong layout_gen;
+ulong treegen = 1;
+
+/* The tiles of the layout by GRIDCELL square of the treemap, for
+ * finding the tile under a point. Cell c holds the tiles
+ * gridtile[gridstart[c]..gridstart[c+1]), in layout order. */
+int *gridstart = nil;
+int *gridtile = nil;
+int maxgridtile = 0;
+Rectangle gridrect;
+int gridw, gridh;
+
+/* The treemap as drawn for the layout above, without a selection */
+Image *treemap_img = nil;
+int treemap_valid = 0;
+
+/* Number of scanner procs (-j) */
+int nscanprocs = 0;
 
-/* Global node counter for unique IDs */
-int next_node_id = 1;
+/* How many of the largest files and directories scans keep (-t) */
+int ntop = NTOP_DEFAULT;
+Top topfiles;
+Top topdirs;
+
+/* Input and background scanning */
+Mousectl *mctl;
+Keyboardctl *kctl;
+Channel *scanc;           /* ScanMsgs from running scans */
+Scan *scan = nil;         /* Scan filling in tree, or nil when it is complete */
+u64int expandsize;        /* Size of the pruned directory being read, before it was */
+long expandentries;       /* And the count of entries below it */
+
+/* Channels the main loop waits on */
+enum {
+	AMOUSE,
+	ARESIZE,
+	AKBD,
+	ASCAN,
+	AEND
+};
+
+static void draw_highlight(int top);
 
 /* Pre-render a directory icon */
 void
@@ -264,6 +324,63 @@ draw_footer(void)
 		text_color, ZP, font, version_str);
 }
 
+/* Put back what the stats overlay covered at r, from the treemap's
+ * backing image as restore_tile does, and the highlight if it was
+ * under there. If the image is out of date, or the overlay reached
+ * past the treemap, those panes are drawn again instead. */
+static void
+unstats(Rectangle r)
+{
+	int i;
+	
+	if(!rectinrect(r, treemap_rect)) {
+		draw_file_list();
+		draw_splitter();
+		draw_treemap();
+		return;
+	}
+	if(current == nil || current != layout_node || layout_gen != treegen || !treemap_valid) {
+		draw_treemap();
+		return;
+	}
+	draw(screen, r, treemap_img, nil, r.min);
+	for(i = 0; i < ntiles; i++)
+		if(tiles[i].top == selected_list_idx && tiles[i].depth == 0 && rectXrect(tiles[i].r, r))
+			draw_highlight(selected_list_idx);
+}
+
+/* Draw the stats overlay in the corner above the footer */
+void
+draw_stats(void)
+{
+	char line[STATS_LINES][STATS_LINELEN];
+	Rectangle r;
+	Point p;
+	int i, n, w;
+	
+	n = statslines(scan, tree, line);
+	w = 0;
+	for(i = 0; i < n; i++)
+		if(stringwidth(font, line[i]) > w)
+			w = stringwidth(font, line[i]);
+	
+	r.max = Pt(footer_rect.max.x - MARGIN, footer_rect.min.y - MARGIN);
+	r.min = Pt(r.max.x - w - 2*PADDING, r.max.y - n*font->height - 2*PADDING);
+	
+	/* It may have shrunk since it was last drawn */
+	if(Dx(statsr) > 0 && !rectinrect(statsr, r))
+		unstats(statsr);
+	statsr = r;
+	draw(screen, r, back, nil, ZP);
+	border(screen, r, 1, border_color, ZP);
+	
+	p = addpt(r.min, Pt(PADDING, PADDING));
+	for(i = 0; i < n; i++) {
+		string(screen, p, text_color, ZP, font, line[i]);
+		p.y += font->height;
+	}
+}
+
 /* Draw the splitter between panes */
 void
 draw_splitter(void)
@@ -284,7 +401,7 @@ draw_list_item(FsNode *node, int index, int is_visible)
 {
 	char size_str[32];
 	Rectangle item_rect;
-	int y_pos;
+	int y_pos, size_width;
 	
 	/* Skip if not visible */
 	if(!is_visible)
@@ -312,8 +429,11 @@ draw_list_item(FsNode *node, int index, int is_visible)
 		draw(screen, item_rect, list_bg, nil, ZP);
 	}
 	
-	/* Format size string */
-	snprint(size_str, sizeof(size_str), "(%s)", format_size(node->size));
+	/* Format size string; an alias is counted where it was first seen */
+	if(node->alias)
+		snprint(size_str, sizeof(size_str), "(alias)");
+	else
+		snprint(size_str, sizeof(size_str), "(%s)", format_size(node->size));
 	
 	/* Calculate vertical centers for better alignment */
 	int item_center_y = y_pos + (LISTITEM_HEIGHT / 2);
@@ -330,12 +450,15 @@ draw_list_item(FsNode *node, int index, int is_visible)
 		draw(screen, rectaddpt(Rect(0, 0, 16, 16), icon_pos), file_icon, nil, ZP);
 	}
 	
-	/* Draw file/directory name (with spacing for icon) */
+	/* Draw file/directory name (with spacing for icon), leaving room
+	 * for the size */
+	size_width = textwidth(font, size_str);
 	string(screen, Pt(item_rect.min.x + PADDING + 24, text_y), 
-		text_color, ZP, font, node->name);
+		text_color, ZP, font,
+		nodelabel(node, font, Dx(item_rect) - 2*PADDING - 24 - size_width - PADDING));
 	
 	/* Right-aligned size string */
-	string(screen, Pt(item_rect.max.x - PADDING - stringwidth(font, size_str), text_y), 
+	string(screen, Pt(item_rect.max.x - PADDING - size_width, text_y), 
 		text_color, ZP, font, size_str);
 	
 	/* Draw bottom border */
@@ -370,7 +493,25 @@ draw_file_list(void)
 	}
 	
 	/* Draw parent directory entry if not at root */
-	if(current != root) {
+	draw_parent_item();
+	
+	/* Only the rows in the viewport need to be in order */
+	loadchildren(snap, current);
+	phasebegin(PHASE_SORT);
+	sort_top_children(current, scroll_offset + list_rows());
+	phaseend();
+	
+	/* Draw list items visible within the viewport - account for parent directory */
+	count = min(current->nchildren, scroll_offset + list_rows());
+	for(i = scroll_offset; i < count; i++)
+		draw_list_item(current->children[i], i, 1);
+}
+
+/* Draw the ".." entry at the top of the list, if not at root */
+void
+draw_parent_item(void)
+{
+	if(current != nil && current != root) {
 		Rectangle parent_rect = Rect(
 			list_rect.min.x,
 			list_rect.min.y,
@@ -405,69 +546,130 @@ draw_file_list(void)
 		);
 		draw(screen, border, border_color, nil, ZP);
 	}
+}
+
+/* Redraw one row of the list: a child's index, or -2 for ".." */
+static void
+draw_list_row(int index)
+{
+	if(current == nil)
+		return;
+	
+	if(index == -2)
+		draw_parent_item();
+	else if(index >= scroll_offset && index < current->nchildren)
+		draw_list_item(current->children[index], index, 1);
+}
+
+/* Fraction of a parent's area a child should get */
+static double
+child_share(FsNode *node, FsNode *child, double total_size)
+{
+	/* If total size is zero, give equal space to all */
+	if(total_size <= 0)
+		return 1.0 / node->nchildren;
+	return (double)child->size / total_size;
+}
+
+/* Record a laid-out rectangle */
+static void
+add_tile(FsNode *node, int index, Rectangle r, int depth, int top, int nrest)
+{
+	Tile *t;
 	
-	/* Draw list items */
-	count = current->nchildren;
-	for(i = 0; i < count; i++) {
-		/* Check if item is visible within the viewport - account for parent directory */
-		int has_parent = (current != root) ? 1 : 0;
-		int is_visible = (i >= scroll_offset && i < scroll_offset + visible_items - has_parent);
-		if(is_visible)
-			draw_list_item(current->children[i], i, is_visible);
+	if(ntiles >= maxtiles) {
+		int newmax = maxtiles == 0 ? 256 : maxtiles * 2;
+		Tile *newtiles = realloc(tiles, newmax * sizeof(Tile));
+		if(newtiles == nil)
+			sysfatal("realloc failed: %r");
+		
+		tiles = newtiles;
+		maxtiles = newmax;
 	}
+	
+	t = &tiles[ntiles++];
+	t->node = node;
+	t->index = index;
+	t->r = r;
+	t->depth = depth;
+	t->top = top;
+	t->nrest = nrest;
 }
 
-/* Enhanced treemap layout algorithm - designed to show recursive patterns */
+/* Enhanced treemap layout algorithm - designed to show recursive patterns.
+ * Appends a tile for each child that gets space, parents before their
+ * children, so drawing the tiles in order paints the nesting correctly.
+ * top is the index in current's children that this subtree hangs off,
+ * or -1 while laying out current itself.
+ *
+ * Only the children that get at least MINBOX pixels are looked at; the
+ * rest share one "N small items" tile. The work done is bounded by the
+ * number of tiles made, however many children a directory has. */
 void
-layout_treemap(FsNode *node, Rectangle avail, int depth)
+layout_treemap(FsNode *node, Rectangle avail, int depth, int top)
 {
 	double total_size;
 	double aspect;
-	int i;
+	Rectangle *rects, rest;
+	int i, k, nshown;
 	
 	if(node == nil || node->nchildren == 0 || depth > MAX_DEPTH_LEVEL)
 		return;
 	
+	/* Read from a snapshot, the children may not be made yet */
+	loadchildren(snap, node);
+	
 	/* Ensure minimum rectangle size */
 	if(Dx(avail) < MINBOX || Dy(avail) < MINBOX)
 		return;
 	
-	/* Store the available rectangle as this node's bounds */
-	node->bounds = avail;
+	/* Select layout pattern based on aspect ratio */
+	aspect = (double)Dx(avail) / Dy(avail);
 	
-	/* Calculate total size of all children */
+	/* Only as many children as fit at MINBOX can get space; order just those */
+	k = (aspect >= 1.0 ? Dx(avail) : Dy(avail)) / MINBOX;
+	if(k > node->nchildren)
+		k = node->nchildren;
+	phasebegin(PHASE_SORT);
+	sort_top_children(node, k);
+	phaseend();
+	
+	/* A finished directory's size is its children's total. Mid-scan
+	 * the children can be ahead of it, so never use less than the ones
+	 * that might be shown. */
 	total_size = 0;
-	for(i = 0; i < node->nchildren; i++)
+	for(i = 0; i < k; i++)
 		total_size += (double)node->children[i]->size;
+	if(total_size < (double)node->size)
+		total_size = (double)node->size;
 	
-	/* If total size is zero, give equal space to all */
-	if(total_size <= 0) {
-		total_size = node->nchildren;
-		for(i = 0; i < node->nchildren; i++)
-			node->children[i]->size = 1;
-	}
-	
-	/* Select layout pattern based on aspect ratio */
-	aspect = (double)Dx(avail) / Dy(avail);
+	rects = malloc(k * sizeof(Rectangle));
+	if(rects == nil)
+		sysfatal("malloc failed: %r");
 	
 	/* Simple layout based on aspect ratio */
 	if(aspect >= 1.0) {
 		/* Horizontal layout for wide rectangles */
-		layout_horizontal(node, avail, total_size);
+		nshown = layout_horizontal(node, avail, total_size, rects, &rest);
 	} else {
 		/* Vertical layout for tall rectangles */
-		layout_vertical(node, avail, total_size);
+		nshown = layout_vertical(node, avail, total_size, rects, &rest);
 	}
 	
+	for(i = 0; i < nshown; i++)
+		add_tile(node->children[i], i, rects[i], depth, top < 0 ? i : top, 0);
+	if(nshown < node->nchildren)
+		add_tile(node, nshown, rest, depth, top, node->nchildren - nshown);
+	
 	/* Recursively layout children with proper padding, but only up to a certain depth
 	 * to avoid going too deep and making the visualization too complex */
 	if(depth < 2) {  /* We show the top few levels in full detail */
-		for(i = 0; i < node->nchildren; i++) {
+		for(i = 0; i < nshown; i++) {
 			FsNode *child = node->children[i];
 			if(child->isdir && child->nchildren > 0) {
-				Rectangle inset = insetrect(child->bounds, MARGIN);
+				Rectangle inset = insetrect(rects[i], MARGIN);
 				if(Dx(inset) > MINBOX && Dy(inset) > MINBOX) {
-					layout_treemap(child, inset, depth + 1);
+					layout_treemap(child, inset, depth + 1, top < 0 ? i : top);
 				}
 			}
 		}
@@ -482,179 +684,252 @@ layout_treemap(FsNode *node, Rectangle avail, int depth)
 		else if(depth == 4) size_threshold = total_size * 0.15; /* 15% of parent's size */
 		else size_threshold = total_size * 0.20; /* 20% of parent's size */
 		
-		for(i = 0; i < node->nchildren && limit < 5; i++) {
+		for(i = 0; i < nshown && limit < 5; i++) {
 			FsNode *child = node->children[i];
 			if(child->isdir && child->nchildren > 0 && child->size >= size_threshold) {
-				Rectangle inset = insetrect(child->bounds, MARGIN);
+				Rectangle inset = insetrect(rects[i], MARGIN);
 				if(Dx(inset) > MINBOX && Dy(inset) > MINBOX) {
-					layout_treemap(child, inset, depth + 1);
+					layout_treemap(child, inset, depth + 1, top);
 					limit++;
 				}
 			}
 		}
 	}
+	
+	free(rects);
+}
+
+/* Range of grid cells a rectangle covers, clipped to the grid */
+static void
+cellrange(Rectangle r, int *x0, int *y0, int *x1, int *y1)
+{
+	*x0 = (r.min.x - gridrect.min.x) / GRIDCELL;
+	*y0 = (r.min.y - gridrect.min.y) / GRIDCELL;
+	*x1 = (r.max.x - 1 - gridrect.min.x) / GRIDCELL;
+	*y1 = (r.max.y - 1 - gridrect.min.y) / GRIDCELL;
+	if(*x0 < 0) *x0 = 0;
+	if(*y0 < 0) *y0 = 0;
+	if(*x1 >= gridw) *x1 = gridw - 1;
+	if(*y1 >= gridh) *y1 = gridh - 1;
 }
 
-/* Layout nodes in a horizontal pattern */
+/* Build the grid over r for the tiles just laid out. A tile is listed
+ * in every cell it touches; nested tiles cover the same cells, so a
+ * cell holds about as many tiles as the layout is deep. */
 void
-layout_horizontal(FsNode *node, Rectangle avail, double total_size)
+index_tiles(Rectangle r)
 {
-	int i;
-	int pos;
-	int remaining;
-	int width;
-	FsNode *child;
-	Rectangle r;
+	int i, c, x, y, x0, y0, x1, y1, ncells;
 	
-	pos = avail.min.x;
-	remaining = Dx(avail);
+	gridrect = r;
+	gridw = (Dx(r) + GRIDCELL - 1) / GRIDCELL;
+	gridh = (Dy(r) + GRIDCELL - 1) / GRIDCELL;
+	ncells = gridw * gridh;
 	
-	/* Use threshold to ensure minimum rectangle sizes */
-	int min_width = MINBOX;
-	int available_children = node->nchildren;
+	free(gridstart);
+	gridstart = mallocz((ncells + 1) * sizeof(int), 1);
+	if(gridstart == nil)
+		sysfatal("malloc failed: %r");
 	
-	/* If we can't fit all children with minimum size, limit how many we show */
-	if(remaining < available_children * min_width) {
-		available_children = remaining / min_width;
-		if(available_children < 1)
-			available_children = 1;
+	/* Count the tiles in each cell, then turn the counts into offsets */
+	for(i = 0; i < ntiles; i++) {
+		if(Dx(tiles[i].r) <= 0 || Dy(tiles[i].r) <= 0)
+			continue;
+		cellrange(tiles[i].r, &x0, &y0, &x1, &y1);
+		for(y = y0; y <= y1; y++)
+			for(x = x0; x <= x1; x++)
+				gridstart[y * gridw + x + 1]++;
+	}
+	for(c = 0; c < ncells; c++)
+		gridstart[c+1] += gridstart[c];
+	
+	if(gridstart[ncells] > maxgridtile) {
+		maxgridtile = gridstart[ncells];
+		free(gridtile);
+		gridtile = malloc(maxgridtile * sizeof(int));
+		if(gridtile == nil)
+			sysfatal("malloc failed: %r");
 	}
 	
-	for(i = 0; i < node->nchildren; i++) {
-		child = node->children[i];
-		
-		/* Skip tiny nodes if we're short on space */
-		if(i >= available_children) {
-			child->bounds = Rect(0, 0, 0, 0); /* Zero-sized rectangle */
+	/* Fill the cells, using each cell's start as a cursor, which
+	 * leaves it at the next cell's start */
+	for(i = 0; i < ntiles; i++) {
+		if(Dx(tiles[i].r) <= 0 || Dy(tiles[i].r) <= 0)
 			continue;
-		}
-		
-		/* Last child gets remaining space, others get proportional space */
-		if(i == available_children - 1) {
-			width = remaining;
-		} else {
-			width = (int)((double)child->size / total_size * Dx(avail));
-			if(width < min_width)
-				width = min_width;
-			if(width > remaining - (available_children - i - 1) * min_width)
-				width = remaining - (available_children - i - 1) * min_width;
-		}
-		
-		/* Ensure width is positive */
-		if(width <= 0)
-			width = 1;
-		
-		/* Create the rectangle for this child */
-		r = Rect(pos, avail.min.y, pos + width, avail.max.y);
-		
-		/* Ensure rectangle is within parent bounds */
-		if(r.max.x > avail.max.x)
-			r.max.x = avail.max.x;
-		
-		child->bounds = r;
-		
-		/* Update position and remaining space */
-		pos += width;
-		remaining -= width;
-		
-		/* Stop if we run out of space */
-		if(remaining <= 0)
+		cellrange(tiles[i].r, &x0, &y0, &x1, &y1);
+		for(y = y0; y <= y1; y++)
+			for(x = x0; x <= x1; x++)
+				gridtile[gridstart[y * gridw + x]++] = i;
+	}
+	for(c = ncells; c > 0; c--)
+		gridstart[c] = gridstart[c-1];
+	gridstart[0] = 0;
+}
+
+/* Split span pixels between a directory's children, largest first,
+ * which must be sorted that far. Children are given space in order
+ * until one would get less than MINBOX; that one and everything after
+ * it share a block at the end, made at least MINBOX long by taking
+ * back the smallest shown children. Fills len with the lengths of the
+ * children shown and returns how many there are; *restlen is the
+ * length of the shared block, 0 if there is none. */
+static int
+split_span(FsNode *node, int span, double total_size, int *len, int *restlen)
+{
+	int n, used, w, k;
+	
+	k = span / MINBOX;
+	if(k > node->nchildren)
+		k = node->nchildren;
+	
+	used = 0;
+	for(n = 0; n < k; n++) {
+		w = (int)(child_share(node, node->children[n], total_size) * span);
+		if(w > span - used)
+			w = span - used;
+		if(w < MINBOX)
 			break;
+		len[n] = w;
+		used += w;
+	}
+	
+	if(n == node->nchildren) {
+		/* Everyone fits; the last child takes up the rounding */
+		len[n-1] += span - used;
+		*restlen = 0;
+		return n;
 	}
+	
+	*restlen = span - used;
+	while(*restlen < MINBOX && n > 0)
+		*restlen += len[--n];
+	
+	return n;
 }
 
-/* Layout nodes in a vertical pattern */
-void
-layout_vertical(FsNode *node, Rectangle avail, double total_size)
+/* Layout nodes in a horizontal pattern, one rectangle per child shown
+ * in rects and the block for the rest in *rest. Returns how many
+ * children are shown. */
+int
+layout_horizontal(FsNode *node, Rectangle avail, double total_size, Rectangle *rects, Rectangle *rest)
 {
-	int i;
-	int pos;
-	int remaining;
-	int height;
-	FsNode *child;
-	Rectangle r;
+	int i, n, pos, restlen;
+	int *len;
 	
-	pos = avail.min.y;
-	remaining = Dy(avail);
+	len = malloc((Dx(avail) / MINBOX + 1) * sizeof(int));
+	if(len == nil)
+		sysfatal("malloc failed: %r");
 	
-	/* Use threshold to ensure minimum rectangle sizes */
-	int min_height = MINBOX;
-	int available_children = node->nchildren;
+	n = split_span(node, Dx(avail), total_size, len, &restlen);
 	
-	/* If we can't fit all children with minimum size, limit how many we show */
-	if(remaining < available_children * min_height) {
-		available_children = remaining / min_height;
-		if(available_children < 1)
-			available_children = 1;
+	pos = avail.min.x;
+	for(i = 0; i < n; i++) {
+		rects[i] = Rect(pos, avail.min.y, pos + len[i], avail.max.y);
+		pos += len[i];
 	}
+	*rest = Rect(pos, avail.min.y, pos + restlen, avail.max.y);
 	
-	for(i = 0; i < node->nchildren; i++) {
-		child = node->children[i];
-		
-		/* Skip tiny nodes if we're short on space */
-		if(i >= available_children) {
-			child->bounds = Rect(0, 0, 0, 0); /* Zero-sized rectangle */
-			continue;
-		}
-		
-		/* Last child gets remaining space, others get proportional space */
-		if(i == available_children - 1) {
-			height = remaining;
-		} else {
-			height = (int)((double)child->size / total_size * Dy(avail));
-			if(height < min_height)
-				height = min_height;
-			if(height > remaining - (available_children - i - 1) * min_height)
-				height = remaining - (available_children - i - 1) * min_height;
-		}
-		
-		/* Ensure height is positive */
-		if(height <= 0)
-			height = 1;
-		
-		/* Create the rectangle for this child */
-		r = Rect(avail.min.x, pos, avail.max.x, pos + height);
-		
-		/* Ensure rectangle is within parent bounds */
-		if(r.max.y > avail.max.y)
-			r.max.y = avail.max.y;
-		
-		child->bounds = r;
-		
-		/* Update position and remaining space */
-		pos += height;
-		remaining -= height;
-		
-		/* Stop if we run out of space */
-		if(remaining <= 0)
-			break;
+	free(len);
+	return n;
+}
+
+/* Layout nodes in a vertical pattern, as layout_horizontal() */
+int
+layout_vertical(FsNode *node, Rectangle avail, double total_size, Rectangle *rects, Rectangle *rest)
+{
+	int i, n, pos, restlen;
+	int *len;
+	
+	len = malloc((Dy(avail) / MINBOX + 1) * sizeof(int));
+	if(len == nil)
+		sysfatal("malloc failed: %r");
+	
+	n = split_span(node, Dy(avail), total_size, len, &restlen);
+	
+	pos = avail.min.y;
+	for(i = 0; i < n; i++) {
+		rects[i] = Rect(avail.min.x, pos, avail.max.x, pos + len[i]);
+		pos += len[i];
+	}
+	*rest = Rect(avail.min.x, pos, avail.max.x, pos + restlen);
+	
+	free(len);
+	return n;
+}
+
+/* Draw the block standing for the children of t->node too small to
+ * get tiles of their own */
+static void
+draw_rest(Image *dst, Tile *t)
+{
+	Rectangle r;
+	FsNode *node;
+	u64int size;
+	char label[64];
+	int i, x, text_y, max_text_width;
+	
+	node = t->node;
+	r = t->r;
+	draw(dst, r, back, nil, ZP);
+	border(dst, r, 1, border_color, ZP);
+	
+	max_text_width = Dx(r) - 2*4;
+	if(Dx(r) <= LABEL_THRESHOLD || Dy(r) <= LABEL_THRESHOLD || max_text_width <= 0)
+		return;
+	
+	x = r.min.x + 4;
+	text_y = r.min.y + 4;
+	snprint(label, sizeof(label), "%d small items", t->nrest);
+	truncate_string(label, font, max_text_width);
+	if(text_y + font->height > r.max.y - 3)
+		return;
+	string(dst, Pt(x, text_y), text_color, ZP, font, label);
+	
+	/* What the shown children leave of the directory */
+	size = node->size;
+	for(i = 0; i < node->nchildren - t->nrest; i++) {
+		if(node->children[i]->size > size)
+			return;
+		size -= node->children[i]->size;
 	}
+	text_y += font->height + 2;
+	snprint(label, sizeof(label), "%s", format_size(size));
+	truncate_string(label, font, max_text_width);
+	if(text_y + font->height <= r.max.y - 3)
+		string(dst, Pt(x, text_y), text_color, ZP, font, label);
 }
 
 /* Draw a single file system node in the treemap */
 void
-draw_node(FsNode *node, int highlight_it)
+draw_node(Image *dst, Tile *t, int highlight_it)
 {
 	Rectangle r;
 	int depth;
-	FsNode *parent;
+	FsNode *node, *parent;
 	char count[32];
 	char size_str[32];
-	char display_name[256];
+	char *display_name;
 	int text_y;
 	int border_thickness;
 	int max_text_width;
 	
-	if(node == nil)
+	if(t == nil || t->node == nil)
 		return;
+	stats.drawing++;
 	
-	/* Get the node's bounds */
-	r = node->bounds;
+	/* Get the node's rectangle */
+	node = t->node;
+	r = t->r;
 	
 	/* Skip if rectangle is too small, invalid, or zero-sized */
 	if(Dx(r) <= 0 || Dy(r) <= 0)
 		return;
 	
+	if(t->nrest > 0) {
+		draw_rest(dst, t);
+		return;
+	}
+	
 	/* Calculate recursive depth for coloring */
 	depth = 0;
 	parent = node->parent;
@@ -666,12 +941,12 @@ draw_node(FsNode *node, int highlight_it)
 	/* Draw filled rectangle with appropriate color */
 	if(highlight_it) {
 		/* For highlighted items, draw background in highlight color */
-		draw(screen, r, highlight, nil, ZP);
+		draw(dst, r, highlight, nil, ZP);
 	} else if(node->isdir) {
 		/* Use depth-based color gradient for directories */
-		draw(screen, r, depth_colors[depth % 8], nil, ZP);
+		draw(dst, r, depth_colors[depth % 8], nil, ZP);
 	} else {
-		draw(screen, r, file_color, nil, ZP);
+		draw(dst, r, file_color, nil, ZP);
 	}
 	
 	/* Determine border thickness based on item type and highlight state */
@@ -687,13 +962,13 @@ draw_node(FsNode *node, int highlight_it)
 	}
 	
 	/* Draw appropriate border */
-	border(screen, r, border_thickness, border_color, ZP);
+	border(dst, r, border_thickness, border_color, ZP);
 	
 	/* Add an inner border for highlighted items for extra emphasis */
 	if(highlight_it) {
 		Rectangle inner = insetrect(r, border_thickness);
 		if(Dx(inner) > 6 && Dy(inner) > 6) {
-			border(screen, inner, 1, highlight, ZP);
+			border(dst, inner, 1, highlight, ZP);
 		}
 	}
 	
@@ -705,13 +980,12 @@ draw_node(FsNode *node, int highlight_it)
 	/* Only draw text if rectangle is large enough */
 	if(Dx(r) > LABEL_THRESHOLD && Dy(r) > LABEL_THRESHOLD) {
 		/* Truncate filename if needed and add ellipsis */
-		strecpy(display_name, display_name+sizeof(display_name), node->name);
-		truncate_string(display_name, font, max_text_width);
+		display_name = nodelabel(node, font, max_text_width);
 		
 		/* Draw filename for large enough rectangles */
 		text_y = r.min.y + border_thickness + 3;
 		if(text_y + font->height <= r.max.y - 3) {
-			string(screen, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, display_name);
+			string(dst, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, display_name);
 			
 			/* If it's a directory, show child count */
 			if(node->isdir) {
@@ -720,7 +994,7 @@ draw_node(FsNode *node, int highlight_it)
 				truncate_string(count, font, max_text_width);
 				
 				if(text_y + font->height <= r.max.y - 3) {
-					string(screen, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, count);
+					string(dst, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, count);
 					
 					/* Show size information */
 					text_y += font->height + 2;
@@ -729,7 +1003,7 @@ draw_node(FsNode *node, int highlight_it)
 					
 					/* Only draw size if we have room */
 					if(text_y + font->height <= r.max.y - 3) {
-						string(screen, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, size_str);
+						string(dst, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, size_str);
 					}
 				}
 			} else {
@@ -740,7 +1014,7 @@ draw_node(FsNode *node, int highlight_it)
 				
 				/* Only draw size if we have room */
 				if(text_y + font->height <= r.max.y - 3) {
-					string(screen, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, size_str);
+					string(dst, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, size_str);
 				}
 			}
 		}
@@ -752,44 +1026,29 @@ draw_node(FsNode *node, int highlight_it)
 		
 		/* Only draw if it fits vertically */
 		if(text_y >= r.min.y && text_y + font->height <= r.max.y) {
-			string(screen, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, count);
+			string(dst, Pt(r.min.x + border_thickness + 3, text_y), text_color, ZP, font, count);
 		}
 	}
 }
 
-/* Truncate a string to fit the given width, adding ellipsis if needed */
-void
-truncate_string(char *s, Font *f, int max_width)
+/* Lay out the current directory's children in r, unless the last
+ * layout still holds; returns the number of tiles */
+int
+layout_current(Rectangle r)
 {
-	int len, width;
-	char ellipsis[] = "...";
-	int ellipsis_width;
-	
-	if(s == nil || s[0] == '\0')
-		return;
-	
-	width = stringwidth(f, s);
-	if(width <= max_width)
-		return;  /* String fits, no truncation needed */
-	
-	ellipsis_width = stringwidth(f, ellipsis);
-	
-	/* If we can't even fit ellipsis, just truncate to empty string */
-	if(max_width < ellipsis_width) {
-		s[0] = '\0';
-		return;
+	if(current != layout_node || !eqrect(r, layout_rect) || layout_gen != treegen) {
+		phasebegin(PHASE_LAYOUT);
+		ntiles = 0;
+		layout_treemap(current, r, 0, -1);
+		index_tiles(r);
+		phaseend();
+		layout_node = current;
+		layout_rect = r;
+		layout_gen = treegen;
+		treemap_valid = 0;
 	}
 	
-	/* Try removing characters until string with ellipsis fits */
-	len = strlen(s);
-	while(len > 0) {
-		s[--len] = '\0';
-		width = stringwidth(f, s) + ellipsis_width;
-		if(width <= max_width) {
-			strcat(s, ellipsis);
-			return;
-		}
-	}
+	return ntiles;
 }
 
 /* Draw the treemap visualization */
@@ -799,75 +1058,84 @@ draw_treemap(void)
 	int i;
 	Rectangle full_treemap;
 	
-	/* Fill treemap area with background */
-	draw(screen, treemap_rect, back, nil, ZP);
-	
-	/* Draw border around treemap */
-	border(screen, treemap_rect, 1, border_color, ZP);
-	
 	/* Return if no data */
-	if(current == nil) {
-		/* Draw "No data" message */
+	if(current == nil || current->nchildren == 0) {
+		ntiles = 0;
+		layout_node = nil;
+		
+		/* Fill treemap area with background */
+		draw(screen, treemap_rect, back, nil, ZP);
+		
+		/* Draw border around treemap */
+		border(screen, treemap_rect, 1, border_color, ZP);
+		
+		/* Draw "No data" or empty directory message */
 		int text_y = treemap_rect.min.y + (Dy(treemap_rect) / 2) + (font->height / 3);
 		string(screen, 
 			Pt(treemap_rect.min.x + PADDING, text_y), 
-			text_color, ZP, font, "No data loaded. Press 'o' to open a directory.");
+			text_color, ZP, font,
+			current == nil ? "No data loaded. Press 'o' to open a directory." : "Empty directory");
 		return;
 	}
 	
 	/* Calculate full treemap area with small margin */
 	full_treemap = insetrect(treemap_rect, MARGIN);
 	
-	/* For an empty directory, just show a message */
-	if(current->nchildren == 0) {
-		/* Draw message if no children */
-		int text_y = treemap_rect.min.y + (Dy(treemap_rect) / 2) + (font->height / 3);
-		string(screen, 
-			Pt(treemap_rect.min.x + PADDING, text_y), 
-			text_color, ZP, font, "Empty directory");
-		return;
+	/* Layout the current directory's children directly within the
+	 * treemap */
+	layout_current(full_treemap);
+	
+	/* The backing image covers the treemap pane, in screen coordinates */
+	if(treemap_img == nil || !eqrect(treemap_img->r, treemap_rect)) {
+		freeimage(treemap_img);
+		treemap_img = allocimage(display, treemap_rect, screen->chan, 0, DNofill);
+		if(treemap_img == nil)
+			sysfatal("allocimage failed for treemap: %r");
+		treemap_valid = 0;
 	}
 	
-	/* Layout the current directory's children directly within the treemap */
-	layout_treemap(current, full_treemap, 0);
-	
-	/* First, draw all direct children of the current directory */
-	for(i = 0; i < current->nchildren; i++) {
-		FsNode *child = current->children[i];
-		int highlight_this = (i == selected_list_idx);
-		draw_node(child, highlight_this);
+	/* Render the layout into it once. Tiles come parents first, so this
+	 * draws the direct children of the current directory and then their
+	 * contents on top. */
+	if(!treemap_valid) {
+		draw(treemap_img, treemap_rect, back, nil, ZP);
+		border(treemap_img, treemap_rect, 1, border_color, ZP);
+		for(i = 0; i < ntiles; i++)
+			draw_node(treemap_img, &tiles[i], 0);
+		treemap_valid = 1;
 	}
 	
-	/* Then, recursively draw the contents of each child */
-	for(i = 0; i < current->nchildren; i++) {
-		FsNode *child = current->children[i];
-		if(child->isdir && child->nchildren > 0) {
-			/* Skip drawing this recursive node if it's the selected item 
-			 * (we already drew it with highlight) */
-			if(i != selected_list_idx) {
-				draw_node_recursive_contents(child);
-			}
+	draw(screen, treemap_rect, treemap_img, nil, treemap_rect.min);
+	draw_highlight(selected_list_idx);
+}
+
+/* Draw the selected child of the current directory highlighted, over
+ * its contents, straight onto the screen */
+static void
+draw_highlight(int top)
+{
+	int i;
+	
+	for(i = 0; i < ntiles; i++) {
+		if(tiles[i].top == top && tiles[i].depth == 0) {
+			draw_node(screen, &tiles[i], 1);
+			return;
 		}
 	}
 }
 
-/* Draw just the children of a node, not the node itself */
-void
-draw_node_recursive_contents(FsNode *node)
+/* Put back a child of the current directory as the backing image has
+ * it. Its contents lie within its own tile, which no other child's
+ * tiles overlap. */
+static void
+restore_tile(int top)
 {
 	int i;
 	
-	if(node == nil || !node->isdir || node->nchildren == 0)
-		return;
-	
-	/* Draw all children */
-	for(i = 0; i < node->nchildren; i++) {
-		FsNode *child = node->children[i];
-		draw_node(child, 0);
-		
-		/* Recursively draw grandchildren */
-		if(child->isdir && child->nchildren > 0) {
-			draw_node_recursive_contents(child);
+	for(i = 0; i < ntiles; i++) {
+		if(tiles[i].top == top && tiles[i].depth == 0) {
+			draw(screen, tiles[i].r, treemap_img, nil, tiles[i].r.min);
+			return;
 		}
 	}
 }
@@ -876,8 +1144,11 @@ draw_node_recursive_contents(FsNode *node)
 void
 draw_ui(void)
 {
+	framebegin();
+	
 	/* Clear screen */
 	draw(screen, screenbounds, back, nil, ZP);
+	statsr = ZR;
 	
 	/* Draw main UI components - order matters! */
 	draw_file_list();
@@ -886,6 +1157,8 @@ draw_ui(void)
 	
 	/* Draw footer LAST to ensure it's on top */
 	draw_footer();
+	if(show_stats)
+		draw_stats();
 	
 	/* If in help state, draw help overlay */
 	if(ui_state == HELP_STATE) {
@@ -910,8 +1183,22 @@ draw_ui(void)
 		p.y += 25; /* Increased spacing */
 		string(screen, p, text_color, ZP, font, "r - Return to root");
 		p.y += 25; /* Increased spacing */
+		string(screen, p, text_color, ZP, font, "f - Refresh: reread only changed directories");
+		p.y += 25; /* Increased spacing */
+		string(screen, p, text_color, ZP, font, "R - Rescan from selected directory");
+		p.y += 25; /* Increased spacing */
+		string(screen, p, text_color, ZP, font, "c - Cancel the running scan");
+		p.y += 25; /* Increased spacing */
+		string(screen, p, text_color, ZP, font, "t - Show the largest files and directories");
+		p.y += 25; /* Increased spacing */
+		string(screen, p, text_color, ZP, font, "s - Toggle timings and counters");
+		p.y += 25; /* Increased spacing */
 		string(screen, p, text_color, ZP, font, "? - Toggle help display");
 		p.y += 25; /* Increased spacing */
+		string(screen, p, text_color, ZP, font, "PgUp/PgDn, Home/End - Move by a screenful, to either end");
+		p.y += 25; /* Increased spacing */
+		string(screen, p, text_color, ZP, font, "nG - Go to row n; G alone goes to the last row");
+		p.y += 25; /* Increased spacing */
 		string(screen, p, text_color, ZP, font, "h - Go left/up to parent (vim-style)");
 		p.y += 25; /* Increased spacing */
 		string(screen, p, text_color, ZP, font, "j - Move down (vim-style)");
@@ -923,10 +1210,194 @@ draw_ui(void)
 		string(screen, p, text_color, ZP, font, "↑/↓ - Navigate list");
 		p.y += 25; /* Increased spacing */
 		string(screen, p, text_color, ZP, font, "Enter - Navigate into selected directory");
-	}
+	} else if(ui_state == TOP_STATE)
+		draw_top_panel();
 	
 	/* Flush image to screen */
-	flushimage(display, 1);
+	frameend();
+}
+
+/* Draw one column of the largest-items panel */
+static void
+draw_top_list(Rectangle r, char *title, Top *t)
+{
+	char path[512];
+	Point p;
+	int i, w, sizew;
+	
+	p = Pt(r.min.x, r.min.y);
+	string(screen, p, text_color, ZP, font, title);
+	p.y += font->height + 10;
+	
+	if(t->n == 0) {
+		string(screen, p, text_color, ZP, font,
+			scan != nil ? "Listed once the scan is done" : "None recorded; press f to rescan");
+		return;
+	}
+	
+	sizew = textwidth(font, "1023.9GB");
+	for(i = 0; i < t->n && p.y + font->height <= r.max.y; i++) {
+		w = textwidth(font, format_size(t->ent[i].size));
+		string(screen, Pt(p.x + sizew - w, p.y), text_color, ZP, font, format_size(t->ent[i].size));
+		
+		/* Leave room for the ellipsis */
+		toppath(t, i, path, sizeof(path) - 3);
+		truncate_string(path, font, Dx(r) - sizew - PADDING);
+		string(screen, Pt(p.x + sizew + PADDING, p.y), text_color, ZP, font, path);
+		p.y += font->height + 4;
+	}
+}
+
+/* Draw the largest files and directories found by the last scan */
+void
+draw_top_panel(void)
+{
+	Rectangle r, col;
+	char title[64];
+	int mid;
+	
+	r = insetrect(screenbounds, 50);
+	draw(screen, r, back, nil, ZP);
+	border(screen, r, 2, border_color, ZP);
+	r = insetrect(r, 10);
+	
+	mid = r.min.x + Dx(r) / 2;
+	col = Rect(r.min.x, r.min.y, mid - PADDING, r.max.y);
+	snprint(title, sizeof(title), "Largest files (%d)", topfiles.n);
+	draw_top_list(col, title, &topfiles);
+	col = Rect(mid + PADDING, r.min.y, r.max.x, r.max.y);
+	snprint(title, sizeof(title), "Largest directories (%d)", topdirs.n);
+	draw_top_list(col, title, &topdirs);
+}
+
+/* Repaint only the damaged parts of the window */
+void
+redraw(int damage)
+{
+	/* The help and largest-items overlays cover everything */
+	if(damage == DALL || ui_state != NORMAL_STATE) {
+		draw_ui();
+		return;
+	}
+	
+	framebegin();
+	if(damage & DLIST)
+		draw_file_list();
+	if(damage & DTREEMAP)
+		draw_treemap();
+	if(damage & DFOOTER)
+		draw_footer();
+	if(show_stats)
+		draw_stats();
+	frameend();
+}
+
+/* Rows of the list that show children; below the root ".." takes
+ * the first */
+int
+list_rows(void)
+{
+	int rows;
+	
+	rows = visible_items;
+	if(current != nil && current != root)
+		rows--;
+	return rows < 1 ? 1 : rows;
+}
+
+/* Scroll the list so that child index is in view, without scrolling
+ * past either end. Costs the same however long the list is. */
+void
+scroll_to(int index)
+{
+	int rows, last;
+	
+	rows = list_rows();
+	if(index >= 0 && index < scroll_offset)
+		scroll_offset = index;
+	else if(index >= scroll_offset + rows)
+		scroll_offset = index - rows + 1;
+	
+	last = current != nil ? current->nchildren - rows : 0;
+	if(scroll_offset > last)
+		scroll_offset = last;
+	if(scroll_offset < 0)
+		scroll_offset = 0;
+}
+
+/* Scroll the list by delta rows, leaving the selection where it is */
+void
+scroll_list(int delta)
+{
+	int oldscroll;
+	
+	if(current == nil || ui_state != NORMAL_STATE)
+		return;
+	
+	oldscroll = scroll_offset;
+	scroll_offset += delta;
+	scroll_to(-1);
+	if(scroll_offset != oldscroll)
+		redraw(DLIST);
+}
+
+/* Select child index, clamped to the list */
+void
+select_row(int index)
+{
+	if(current == nil || current->nchildren == 0)
+		return;
+	
+	if(index >= current->nchildren)
+		index = current->nchildren - 1;
+	if(index < 0)
+		index = 0;
+	select_item(index);
+}
+
+/* Move the selection to index (-2 for ".."), scrolling it into view.
+ * Unless the list scrolls, only the two rows and the two children's
+ * tiles involved are repainted. */
+void
+select_item(int index)
+{
+	int old, oldscroll;
+	
+	old = selected_list_idx;
+	oldscroll = scroll_offset;
+	selected_list_idx = index;
+	
+	/* Adjust scroll if necessary */
+	scroll_to(index);
+	
+	if(index == old && scroll_offset == oldscroll)
+		return;
+	
+	if(ui_state != NORMAL_STATE) {
+		draw_ui();
+		return;
+	}
+	
+	framebegin();
+	if(scroll_offset != oldscroll)
+		draw_file_list();
+	else {
+		draw_list_row(old);
+		draw_list_row(index);
+	}
+	
+	/* The treemap is a copy of one tile from the backing image plus a
+	 * highlight, unless the layout or the image is out of date */
+	if(current != layout_node || layout_gen != treegen || !treemap_valid)
+		draw_treemap();
+	else {
+		restore_tile(old);
+		draw_highlight(index);
+	}
+	
+	if(show_stats)
+		draw_stats();
+	frameend();
 }
 
 /* Initialize drawing environment */
@@ -936,7 +1407,12 @@ setup_draw(void)
 	if(initdraw(nil, nil, "dufus - disk usage analyzer") < 0)
 		sysfatal("initdraw failed: %r");
 	
-	einit(Emouse | Ekeyboard);
+	mctl = initmouse(nil, screen);
+	if(mctl == nil)
+		sysfatal("initmouse failed: %r");
+	kctl = initkeyboard(nil);
+	if(kctl == nil)
+		sysfatal("initkeyboard failed: %r");
 	
 	calculate_layout();
 	init_colors();
@@ -960,6 +1436,39 @@ format_size(u64int size)
 	return buf;
 }
 
+/* Parse a size such as 4096, 300K or 2G; returns -1 if s is not one */
+vlong
+parsesize(char *s)
+{
+	char *e;
+	vlong n;
+	
+	n = strtoll(s, &e, 10);
+	if(e == s || n < 0)
+		return -1;
+	switch(*e) {
+	case 'k':
+	case 'K':
+		n *= KB;
+		e++;
+		break;
+	case 'm':
+	case 'M':
+		n *= MB;
+		e++;
+		break;
+	case 'g':
+	case 'G':
+		n *= GB;
+		e++;
+		break;
+	}
+	if(*e != '\0')
+		return -1;
+	
+	return n;
+}
+
 /* Update status message */
 void
 update_status(char *fmt, ...)
@@ -971,237 +1480,457 @@ update_status(char *fmt, ...)
 	va_end(arg);
 }
 
-/* Create a new filesystem node */
-FsNode*
-create_fsnode(char *name, char *path, u64int size, int isdir, FsNode *parent)
+/* Find the tile at a given point in the treemap, or nil. Only the
+ * layout on screen is searched, and only the tiles in the point's
+ * grid cell are tested. */
+Tile*
+find_tile_at_point(Point p)
 {
-	FsNode *node = mallocz(sizeof(FsNode), 1);
-	if(node == nil)
-		sysfatal("malloc failed: %r");
+	int c, i;
+	Tile *t;
 	
-	strecpy(node->name, node->name+sizeof(node->name), name);
-	strecpy(node->path, node->path+sizeof(node->path), path);
-	node->size = size;
-	node->isdir = isdir;
-	node->parent = parent;
-	node->children = nil;
-	node->nchildren = 0;
-	node->maxchildren = 0;
-	node->color = isdir ? dir_color : file_color;
-	node->id = next_node_id++;
+	if(current == nil || current != layout_node || layout_gen != treegen)
+		return nil;
+	if(!ptinrect(p, gridrect))
+		return nil;
+	
+	/* Later tiles are nested inside earlier ones; we want the innermost.
+	 * A block of small items stands for no one node, so a click there
+	 * goes to the directory around it. */
+	c = (p.y - gridrect.min.y) / GRIDCELL * gridw + (p.x - gridrect.min.x) / GRIDCELL;
+	for(i = gridstart[c+1] - 1; i >= gridstart[c]; i--) {
+		t = &tiles[gridtile[i]];
+		if(t->nrest == 0 && ptinrect(p, t->r))
+			return t;
+	}
 	
-	return node;
+	return nil;
 }
 
-/* Add a child to a node */
-void
-add_child(FsNode *parent, FsNode *child)
+/* Find the list item index at the given point */
+int
+find_list_item_at_point(Point p)
 {
-	if(parent == nil || child == nil)
-		return;
+	int index;
+	int offset = (current != root) ? 1 : 0; /* Adjust for parent directory entry */
 	
-	if(parent->nchildren >= parent->maxchildren) {
-		int newmax = parent->maxchildren == 0 ? 16 : parent->maxchildren * 2;
-		FsNode **newchildren = realloc(parent->children, newmax * sizeof(FsNode*));
-		if(newchildren == nil)
-			sysfatal("realloc failed: %r");
-		
-		parent->children = newchildren;
-		parent->maxchildren = newmax;
-	}
+	if(!ptinrect(p, list_rect))
+		return -1;
+	
+	/* Check if it's the parent directory item */
+	if(current != root && p.y < list_rect.min.y + LISTITEM_HEIGHT)
+		return -2; /* Special case for ".." */
+	
+	/* Calculate index based on Y position, accounting for parent directory offset */
+	index = ((p.y - list_rect.min.y) / LISTITEM_HEIGHT) - offset + scroll_offset;
+	
+	/* Check if index is valid */
+	if(current != nil && index >= 0 && index < current->nchildren)
+		return index;
 	
-	parent->children[parent->nchildren++] = child;
+	return -1;
+}
+
+/* Drop the current tree */
+static void
+close_tree(void)
+{
+	/* A running scan still owns its tree; handle_scan() frees both
+	 * once the scan has stopped. Otherwise the whole tree goes in
+	 * one release. */
+	if(scan != nil) {
+		cancelscan(scan);
+		scan = nil;
+	} else
+		freearena(tree);
+	topfree(&topfiles);
+	topfree(&topdirs);
+	tree = nil;
+	snap = nil;
+	root = nil;
+	current = nil;
+	treegen++;
 }
 
-/* Sort nodes by size (largest first) */
+/* Open and analyze a directory. The scan runs in the background and
+ * handle_scan() redraws as it goes, so this returns right away. */
 void
-sort_nodes_by_size(FsNode *parent)
+open_directory(char *path)
 {
-	int i, j;
-	FsNode *temp;
+	close_tree();
 	
-	if(parent == nil || parent->nchildren <= 1)
-		return;
+	/* Store current path */
+	strecpy(current_path, current_path+sizeof(current_path), path);
 	
-	/* Simple bubble sort */
-	for(i = 0; i < parent->nchildren - 1; i++) {
-		for(j = 0; j < parent->nchildren - i - 1; j++) {
-			if(parent->children[j]->size < parent->children[j+1]->size) {
-				temp = parent->children[j];
-				parent->children[j] = parent->children[j+1];
-				parent->children[j+1] = temp;
-			}
-		}
-	}
+	/* Create root node and start scanning into it */
+	tree = newarena();
+	root = create_fsnode(tree, path, 0, 1, nil);
+	current = root;
+	scan = startscan(tree, path, root, nil, nscanprocs, scanc);
+	
+	/* Reset UI state; the selection appears with the first entries */
+	scroll_offset = 0;
+	selected_list_idx = -1;
+	
+	update_status("Scanning %s...", path);
 }
 
-/* Recursively scan a directory and build the tree */
-void
-scan_directory(char *path, FsNode *parent)
+/* Open a tree saved with -w; returns -1 with the error set, leaving
+ * the current tree alone */
+int
+open_snapshot(char *file)
 {
-	Dir *dirents;
-	int ndirents, i;
-	u64int total = 0;
-	char fullpath[1024];
-	int fd;
-	
-	fd = open(path, OREAD);
-	if(fd < 0) {
-		fprint(2, "open failed for %s: %r\n", path);
-		return;
+	Arena *a;
+	Snap *sn;
+	
+	a = newarena();
+	sn = readsnap(a, file);
+	if(sn == nil) {
+		freearena(a);
+		return -1;
 	}
 	
-	ndirents = dirread(fd, &dirents);
-	close(fd);
+	close_tree();
+	tree = a;
+	snap = sn;
+	root = sn->root;
+	current = root;
+	strecpy(current_path, current_path+sizeof(current_path), root->name);
 	
-	if(ndirents < 0) {
-		fprint(2, "dirread failed for %s: %r\n", path);
-		return;
-	}
+	scroll_offset = 0;
+	selected_list_idx = current->nchildren > 0 ? 0 : -1;
 	
-	/* Initialize parent size to zero - will accumulate total */
-	parent->size = 0;
+	update_status("Snapshot %s: %s (%s) - %lud nodes",
+		file, current_path, format_size(root->size), sn->nnodes);
+	return 0;
+}
+
+/* Load and fully order every directory under node */
+static void
+settle_tree(FsNode *node)
+{
+	int i;
 	
-	/* First pass: create nodes for all entries */
-	for(i = 0; i < ndirents; i++) {
-		/* Skip "." and ".." */
-		if(strcmp(dirents[i].name, ".") == 0 || strcmp(dirents[i].name, "..") == 0)
-			continue;
-		
-		snprint(fullpath, sizeof(fullpath), "%s/%s", path, dirents[i].name);
-		
-		int isdir = (dirents[i].qid.type & QTDIR);
-		u64int size = dirents[i].length;
-		
-		FsNode *child = create_fsnode(dirents[i].name, fullpath, size, isdir, parent);
-		add_child(parent, child);
-	}
-	
-	/* Sort children by size (provisional) to process larger ones first */
-	sort_nodes_by_size(parent);
-	
-	/* Second pass: scan subdirectories and update sizes */
-	for(i = 0; i < parent->nchildren; i++) {
-		FsNode *child = parent->children[i];
-		if(child->isdir) {
-			/* Recursively scan subdirectories */
-			scan_directory(child->path, child);
-			/* Update the running total with this subdirectory's size */
-			total += child->size;
-		} else {
-			/* For files, just add the file size */
-			total += child->size;
-		}
-		
-		/* Update status periodically to show progress */
-		if(i % 10 == 0) {
-			update_status("Scanning %s... (%d/%d)", path, i, parent->nchildren);
-			draw_footer();
-			flushimage(display, 1);
-		}
+	loadchildren(snap, node);
+	phasebegin(PHASE_SORT);
+	sort_nodes_by_size(node);
+	phaseend();
+	for(i = 0; i < node->nchildren; i++)
+		if(node->children[i]->nchildren > 0)
+			settle_tree(node->children[i]);
+}
+
+/* Rescan the tree in the background, reading only the directories that
+ * have changed since it was scanned. The old tree stays on screen until
+ * the new one is complete. */
+void
+refresh_tree(void)
+{
+	Arena *a;
+	FsNode *newroot;
+	
+	if(root == nil)
+		return;
+	if(scan != nil) {
+		update_status("Can't refresh while a scan is running");
+		return;
 	}
 	
-	/* Update parent's size to include all children */
-	parent->size = total;
+	/* The scanner procs read the old tree as they go. Load and order
+	 * all of it now, so that browsing it meanwhile changes nothing. */
+	settle_tree(root);
 	
-	/* Re-sort children by size after all calculations */
-	sort_nodes_by_size(parent);
+	a = newarena();
+	newroot = create_fsnode(a, root->name, 0, 1, nil);
+	scan = startscan(a, current_path, newroot, root, nscanprocs, scanc);
+	scan->oldtree = tree;
 	
-	free(dirents);
+	update_status("Refreshing %s...", current_path);
 }
 
-/* Free all resources for a node and its children */
-void
-clear_fsnode(FsNode *node)
+/* The node at the same path in the tree under newroot as old, or nil */
+static FsNode*
+samenode(FsNode *newroot, FsNode *old)
 {
+	FsNode *p;
 	int i;
 	
-	if(node == nil)
-		return;
+	if(old->parent == nil)
+		return newroot;
 	
-	for(i = 0; i < node->nchildren; i++)
-		clear_fsnode(node->children[i]);
+	p = samenode(newroot, old->parent);
+	if(p == nil)
+		return nil;
+	for(i = 0; i < p->nchildren; i++)
+		if(strcmp(p->children[i]->name, old->name) == 0)
+			return p->children[i];
 	
-	free(node->children);
-	free(node);
+	return nil;
 }
 
-/* Find a node at a given point in the treemap */
-FsNode*
-find_node_at_point(FsNode *node, Point p)
+/* Put the selection back on sel, whose index moves as sizes change */
+static void
+reselect(FsNode *sel)
 {
 	int i;
-	FsNode *result;
 	
-	if(node == nil || !ptinrect(p, treemap_rect))
-		return nil;
+	phasebegin(PHASE_SORT);
+	sort_top_children(current, scroll_offset + visible_items);
+	phaseend();
+	if(sel != nil) {
+		for(i = 0; i < current->nchildren; i++) {
+			if(current->children[i] == sel) {
+				selected_list_idx = i;
+				break;
+			}
+		}
+	} else if(selected_list_idx == -1 && current->nchildren > 0)
+		selected_list_idx = 0;
+}
+
+/* Read a directory left pruned by the depth limit, in the background.
+ * It is scanned in place, and as deep again. */
+static void
+expand_node(FsNode *node)
+{
+	char *path;
+	
+	if(scan != nil) {
+		update_status("Can't read %s while a scan is running", node->name);
+		return;
+	}
 	
-	/* First check if the point is within this node's bounds */
-	if(ptinrect(p, node->bounds)) {
-		/* Check children first - we want the most specific/innermost node */
-		for(i = 0; i < node->nchildren; i++) {
-			result = find_node_at_point(node->children[i], p);
-			if(result != nil)
-				return result;
+	path = smprint("%N", node);
+	if(path == nil)
+		sysfatal("smprint failed: %r");
+	expandsize = node->size;
+	expandentries = node->maxchildren;
+	node->maxchildren = 0;
+	node->pruned = 0;
+	scan = startscan(tree, path, node, nil, nscanprocs, scanc);
+	free(path);
+	
+	update_status("Reading %N...", node);
+}
+
+/* Handle a message from the scan of a pruned directory */
+static void
+handle_expand(ScanMsg *m)
+{
+	Scan *s = m->scan;
+	FsNode *node, *p, *sel;
+	long ndirs, nentries, nsame;
+	vlong delta;
+	
+	node = s->root;
+	sel = nil;
+	if(selected_list_idx >= 0 && selected_list_idx < current->nchildren)
+		sel = current->children[selected_list_idx];
+	
+	if(m->done && (s->cancel || s->err[0] != '\0')) {
+		/* Put it back as it was, unread, so it can be read again; the
+		 * view moves out of anything that was read. A directory that
+		 * can't be opened any more keeps the size it was scanned with. */
+		if(s->cancel)
+			update_status("Reading %N cancelled", node);
+		else
+			update_status("Can't read %N: %s", node, s->err);
+		endscan(s);
+		scan = nil;
+		
+		for(p = current; p != nil; p = p->parent) {
+			if(p == node) {
+				current = node;
+				scroll_offset = 0;
+				selected_list_idx = -1;
+				sel = nil;
+				break;
+			}
 		}
+		node->nchildren = 0;
+		node->children = nil;
+		node->nsorted = 0;
+		node->size = expandsize;
+		node->maxchildren = expandentries;
+		coherence();
+		node->pruned = 1;
+		unsort_all();
+	} else if(m->done) {
+		endscan(s);
+		scan = nil;
 		
-		/* If no child contains the point, return this node */
-		return node;
+		/* The directories above held its size from the first scan */
+		delta = node->size - expandsize;
+		for(p = node->parent; p != nil; p = p->parent)
+			p->size += delta;
+		unsort_all();
+		update_status("Current: %N (%s)", node, format_size(node->size));
+	} else {
+		/* Sizes have grown wherever the scan has been, which
+		 * directories shown before may be again */
+		unsort_all();
+		scanprogress(s, &ndirs, &nentries, &nsame);
+		update_status("Reading %N... (%ld dirs, %ld entries, %s so far)",
+			node, ndirs, nentries, format_size(node->size));
 	}
+	treegen++;
 	
-	/* Point not in this node */
-	return nil;
+	reselect(sel);
+	draw_ui();
 }
 
-/* Find the list item index at the given point */
-int
-find_list_item_at_point(Point p)
+/* Handle a message from a refresh: once the new tree is complete, move
+ * the view across to the same place in it */
+static void
+handle_refresh(ScanMsg *m)
 {
-	int index;
-	int offset = (current != root) ? 1 : 0; /* Adjust for parent directory entry */
+	Scan *s = m->scan;
+	Arena *a;
+	FsNode *newroot, *newcur, *sel;
+	long ndirs, nentries, nsame;
+	int i, cancelled;
+	
+	scanprogress(s, &ndirs, &nentries, &nsame);
+	if(!m->done) {
+		update_status("Refreshing %s... (%ld dirs read, %ld unchanged)",
+			current_path, ndirs, nsame);
+		redraw(DFOOTER);
+		return;
+	}
 	
-	if(!ptinrect(p, list_rect))
-		return -1;
+	cancelled = s->cancel;
+	a = s->tree;
+	newroot = s->root;
+	if(!cancelled) {
+		topfree(&topfiles);
+		topfree(&topdirs);
+		scantop(s, &topfiles, &topdirs);
+	}
+	endscan(s);
+	scan = nil;
 	
-	/* Check if it's the parent directory item */
-	if(current != root && p.y < list_rect.min.y + LISTITEM_HEIGHT)
-		return -2; /* Special case for ".." */
+	if(cancelled) {
+		freearena(a);
+		update_status("Refresh of %s cancelled", current_path);
+		draw_ui();
+		return;
+	}
 	
-	/* Calculate index based on Y position, accounting for parent directory offset */
-	index = ((p.y - list_rect.min.y) / LISTITEM_HEIGHT) - offset + scroll_offset;
+	newcur = samenode(newroot, current);
+	sel = nil;
+	if(newcur != nil && selected_list_idx >= 0 && selected_list_idx < current->nchildren)
+		sel = samenode(newroot, current->children[selected_list_idx]);
 	
-	/* Check if index is valid */
-	if(current != nil && index >= 0 && index < current->nchildren)
-		return index;
+	freearena(tree);
+	tree = a;
+	snap = nil;
+	root = newroot;
+	treegen++;
+	current = newcur != nil ? newcur : root;
 	
-	return -1;
+	scroll_offset = 0;
+	selected_list_idx = current->nchildren > 0 ? 0 : -1;
+	if(sel != nil) {
+		phasebegin(PHASE_SORT);
+		sort_nodes_by_size(current);
+		phaseend();
+		for(i = 0; i < current->nchildren; i++)
+			if(current->children[i] == sel)
+				selected_list_idx = i;
+		scroll_to(selected_list_idx);
+	}
+	
+	update_status("Refreshed %s (%s) - read %ld changed directories, %ld unchanged",
+		current_path, format_size(root->size), ndirs, nsame);
+	draw_ui();
 }
 
-/* Open and analyze a directory */
+/* Handle a message from a scan: redraw with what it has found so far,
+ * or wrap up once it is over */
 void
-open_directory(char *path)
+handle_scan(ScanMsg *m)
 {
-	/* Clean up existing data if any */
-	if(root != nil) {
-		clear_fsnode(root);
-		root = nil;
-		current = nil;
+	Scan *s = m->scan;
+	Arena *a, *old;
+	FsNode *sel;
+	TreeStats ts;
+	long ndirs, nentries, nsame, naliases, nskipped, nfolded;
+	vlong skipbytes, nodebytes;
+	int n, cancelled;
+	
+	/* A scan that was cancelled to open another directory */
+	if(s != scan) {
+		if(m->done) {
+			a = s->tree;
+			old = s->oldtree;
+			endscan(s);
+			freearena(a);
+			freearena(old);
+		}
+		return;
 	}
 	
-	/* Store current path */
-	strecpy(current_path, current_path+sizeof(current_path), path);
-	
-	/* Create root node and scan directory */
-	root = create_fsnode(path, path, 0, 1, nil);
-	current = root;
-	scan_directory(path, root);
+	if(s->old != nil) {
+		handle_refresh(m);
+		return;
+	}
+	if(s->root != root) {
+		handle_expand(m);
+		return;
+	}
 	
-	/* Reset UI state */
-	scroll_offset = 0;
-	selected_list_idx = current->nchildren > 0 ? 0 : -1;
+	/* Remember the selected node; its index moves as sizes change */
+	sel = nil;
+	if(selected_list_idx >= 0 && selected_list_idx < current->nchildren)
+		sel = current->children[selected_list_idx];
+	
+	if(m->done) {
+		cancelled = s->cancel;
+		scanaliases(s, &naliases, &nskipped, &skipbytes);
+		scanfolded(s, &nfolded, &nodebytes);
+		scantop(s, &topfiles, &topdirs);
+		endscan(s);
+		scan = nil;
+		
+		/* Anything ordered while the scan ran was ordered by partial sizes */
+		unsort_all();
+		treegen++;
+		
+		/* Update status with size and memory information */
+		arenastats(tree, &ts);
+		update_status("%s: %s (%s) - %ld nodes, %lld bytes/node, arena %s in %ld chunks",
+			cancelled ? "Cancelled" : "Current", current_path, format_size(root->size),
+			ts.nodes, (ts.chunkbytes + ts.namebytes) / ts.nodes,
+			format_size(ts.chunkbytes), ts.chunks);
+		
+		/* Trees bound in more than one place were only read once */
+		if(naliases > 0) {
+			n = strlen(status_message);
+			snprint(status_message+n, sizeof(status_message)-n,
+				" - %ld aliases not reread, saving %ld dirs, %s",
+				naliases, nskipped, format_size(skipbytes));
+		}
+		
+		/* What did not fit in the memory budget */
+		if(nfolded > 0) {
+			n = strlen(status_message);
+			snprint(status_message+n, sizeof(status_message)-n,
+				" - %ld entries folded to stay within %s",
+				nfolded, format_size(membudget));
+		}
+	} else {
+		/* Sizes have grown wherever the scan has been, which
+		 * directories shown before may be again */
+		unsort_all();
+		treegen++;
+		
+		scanprogress(s, &ndirs, &nentries, &nsame);
+		update_status("Scanning %s... (%ld dirs, %ld entries, %s so far)",
+			current_path, ndirs, nentries, format_size(root->size));
+	}
 	
-	/* Update status with size information */
-	update_status("Current: %s (%s)", path, format_size(root->size));
+	reselect(sel);
+	draw_ui();
 }
 
 /* Navigate to selected directory */
@@ -1218,6 +1947,10 @@ navigate_to_selected(void)
 		scroll_offset = 0;
 		selected_list_idx = current->nchildren > 0 ? 0 : -1;
 		update_status("Current: %s (%s)", current->name, format_size(current->size));
+		
+		/* Its entries were only added up; read them now */
+		if(current->pruned)
+			expand_node(current);
 	}
 }
 
@@ -1237,10 +1970,25 @@ navigate_up(void)
 void
 navigate(Rune key)
 {
+	static int rownum;
+	
+	/* Digits make up a row number for G */
+	if(key >= '0' && key <= '9') {
+		if(rownum < 100000000)
+			rownum = rownum * 10 + key - '0';
+		update_status("Go to row %d", rownum);
+		redraw(DFOOTER);
+		return;
+	}
+	if(key != 'G')
+		rownum = 0;
+	
 	switch(key) {
 	case 'q':
 		/* Quit */
-		exits(nil);
+		if(exit_stats)
+			printstats(2, scan, tree);
+		threadexitsall(nil);
 		break;
 		
 	case 'o':
@@ -1252,6 +2000,35 @@ navigate(Rune key)
 		}
 		break;
 		
+	case 'c':
+		/* Stop the scan, keeping what it has found */
+		if(scan != nil) {
+			cancelscan(scan);
+			update_status("Cancelling scan of %s...", current_path);
+		} else
+			update_status("No scan running");
+		redraw(DFOOTER);
+		break;
+		
+	case 'R':
+		/* Rescan with the selected directory as the root */
+		if(current != nil && selected_list_idx >= 0 && selected_list_idx < current->nchildren &&
+		   current->children[selected_list_idx]->isdir) {
+			char *path = smprint("%N", current->children[selected_list_idx]);
+			if(path == nil)
+				sysfatal("smprint failed: %r");
+			open_directory(path);
+			free(path);
+			draw_ui();
+		}
+		break;
+		
+	case 'f':
+		/* Rescan, reading only directories that have changed */
+		refresh_tree();
+		redraw(DFOOTER);
+		break;
+		
 	case 'u':
 	case 'h': /* vim-style: left / also go up to parent */
 		/* Go up to parent */
@@ -1270,6 +2047,18 @@ navigate(Rune key)
 		}
 		break;
 		
+	case 't':
+		/* Show the largest files and directories */
+		ui_state = TOP_STATE;
+		draw_ui();
+		break;
+		
+	case 's':
+		/* Show where the time goes */
+		show_stats = !show_stats;
+		draw_ui();
+		break;
+		
 	case '?': /* Alternative trigger for help screen */
 		/* Toggle help */
 		ui_state = (ui_state == NORMAL_STATE) ? HELP_STATE : NORMAL_STATE;
@@ -1280,21 +2069,17 @@ navigate(Rune key)
 	case Kup:
 		/* Move selection up */
 		if(current != nil && current->nchildren > 0) {
-			selected_list_idx--;
+			int index = selected_list_idx - 1;
 			
 			/* Handle parent directory special case */
-			if(selected_list_idx < 0) {
+			if(index < 0) {
 				if(current != root)
-					selected_list_idx = -2; /* ".." special case */
+					index = -2; /* ".." special case */
 				else
-					selected_list_idx = 0;
+					index = 0;
 			}
 			
-			/* Adjust scroll if necessary */
-			if(selected_list_idx >= 0 && selected_list_idx < scroll_offset)
-				scroll_offset = selected_list_idx;
-			
-			draw_ui();
+			select_item(index);
 		}
 		break;
 		
@@ -1302,23 +2087,50 @@ navigate(Rune key)
 	case Kdown:
 		/* Move selection down */
 		if(current != nil) {
+			int index;
+			
 			/* Handle parent directory special case */
 			if(selected_list_idx == -2)
-				selected_list_idx = 0;
+				index = 0;
 			else
-				selected_list_idx++;
+				index = selected_list_idx + 1;
 			
-			if(selected_list_idx >= current->nchildren)
-				selected_list_idx = current->nchildren - 1;
+			if(index >= current->nchildren)
+				index = current->nchildren - 1;
 			
-			/* Adjust scroll if necessary */
-			if(selected_list_idx >= scroll_offset + visible_items)
-				scroll_offset = selected_list_idx - visible_items + 1;
-			
-			draw_ui();
+			select_item(index);
 		}
 		break;
 		
+	case Kpgdown:
+		/* Move the selection a screenful down */
+		if(current != nil)
+			select_row((selected_list_idx < 0 ? 0 : selected_list_idx) + list_rows());
+		break;
+		
+	case Kpgup:
+		/* Move the selection a screenful up */
+		if(current != nil)
+			select_row(selected_list_idx - list_rows());
+		break;
+		
+	case Khome:
+		select_row(0);
+		break;
+		
+	case Kend:
+		select_row(current != nil ? current->nchildren - 1 : 0);
+		break;
+		
+	case 'G':
+		/* Jump to the row typed before it, or to the last row */
+		if(rownum > 0)
+			select_row(rownum - 1);
+		else if(current != nil)
+			select_row(current->nchildren - 1);
+		rownum = 0;
+		break;
+		
 	case '\n':
 	case 'l': /* vim-style: right */
 	case Kright:
@@ -1356,6 +2168,7 @@ handle_key(Rune key)
 		break;
 		
 	case HELP_STATE:
+	case TOP_STATE:
 		/* Any key dismisses help */
 		ui_state = NORMAL_STATE;
 		draw_ui();
@@ -1363,135 +2176,341 @@ handle_key(Rune key)
 	}
 }
 
+/* Handle mouse input; a click acts when the button goes down */
+void
+handle_mouse(Mouse *m)
+{
+	static int obuttons;
+	int pressed;
+	
+	pressed = m->buttons & ~obuttons;
+	obuttons = m->buttons;
+	
+	/* The wheel scrolls the list a few rows at a time */
+	if(pressed & (8|16)) {
+		if(ptinrect(m->xy, list_rect))
+			scroll_list(pressed & 8 ? -WHEEL_ROWS : WHEEL_ROWS);
+		return;
+	}
+	
+	if(pressed & 1) {
+		/* Left click in list view */
+		if(ptinrect(m->xy, list_rect)) {
+			int list_idx = find_list_item_at_point(m->xy);
+			
+			/* Handle click on ".." */
+			if(list_idx == -2) {
+				navigate_up();
+				draw_ui();
+			}
+			/* Handle double-click to navigate */
+			else if(list_idx >= 0 && current->children[list_idx]->isdir) {
+				/* TODO: proper double-click detection */
+				selected_list_idx = list_idx;
+				navigate_to_selected();
+				draw_ui();
+			}
+			/* A file just becomes the selection */
+			else if(list_idx >= 0)
+				select_item(list_idx);
+		}
+		
+		/* Left click in treemap view */
+		else if(ptinrect(m->xy, treemap_rect)) {
+			Tile *t = find_tile_at_point(m->xy);
+			if(t != nil) {
+				/* A direct child of current is just selected */
+				if(t->node->parent == current)
+					select_item(t->index);
+				/* Otherwise go to the directory holding it and select it there */
+				else if(t->node->parent != nil) {
+					current = t->node->parent;
+					selected_list_idx = t->index;
+					
+					/* Adjust scroll to show selected item */
+					scroll_to(selected_list_idx);
+					
+					/* Update status message */
+					update_status("Current: %N (%s)", current, format_size(current->size));
+					draw_ui();
+				}
+			}
+		}
+	}
+}
+
 /* Handle window resize */
 void
-eresized(int new)
+resized(void)
 {
-	if(new && getwindow(display, Refnone) < 0)
+	if(getwindow(display, Refnone) < 0)
 		sysfatal("getwindow: %r");
 	
 	calculate_layout();
 	draw_ui();
 }
 
+/* Print the largest files and directories for -t */
+static void
+print_top(void)
+{
+	char path[1024];
+	int i;
+	
+	print("largest files:\n");
+	for(i = 0; i < topfiles.n; i++) {
+		toppath(&topfiles, i, path, sizeof(path));
+		print("%s\t%s\n", format_size(topfiles.ent[i].size), path);
+	}
+	print("largest directories:\n");
+	for(i = 0; i < topdirs.n; i++) {
+		toppath(&topdirs, i, path, sizeof(path));
+		print("%s\t%s\n", format_size(topdirs.ent[i].size), path);
+	}
+}
+
 /* Display usage information */
 void
 usage(void)
 {
-	fprint(2, "usage: dufus [directory]\n");
-	exits("usage");
+	fprint(2, "usage: dufus [-S] [-j nproc] [-l depth] [-m size] [-p [-d depth] [-s size]] [-t n] [-w snapshot] [directory]\n");
+	fprint(2, "       dufus [-S] [-j nproc] [-l depth] [-m size] -e ndjson|csv [directory]\n");
+	fprint(2, "       dufus -a addr [-i inflight] [-L ms] [options] [path]\n");
+	fprint(2, "       dufus -g shape[:entries[:seed]] [options] [path]\n");
+	fprint(2, "       dufus [-S] -r snapshot\n");
+	fprint(2, "       dufus [-S] -B [directory]\n");
+	threadexitsall("usage");
 }
 
 /* Main function */
 void
-main(int argc, char *argv[])
+threadmain(int argc, char *argv[])
 {
 	char *path = ".";
-	Event ev;
+	char *s, *rfile, *wfile, *addr, *gen;
+	int report, stream, export, bench;
+	Scan *sc;
+	Mouse m;
+	Rune r;
+	ScanMsg sm;
+	Alt alts[AEND+1];
 	
 	argv0 = argv[0];
+	fmtinstall('N', nodefmt);
+	rfile = nil;
+	wfile = nil;
+	addr = nil;
+	gen = nil;
+	bench = 0;
+	report = 0;
+	stream = 0;
+	export = 0;
 	
 	ARGBEGIN {
+	case 'B':
+		bench = 1;
+		break;
+	case 'S':
+		exit_stats = 1;
+		break;
+	case 'a':
+		addr = EARGF(usage());
+		break;
+	case 'g':
+		gen = EARGF(usage());
+		break;
+	case 'i':
+		ninflight = atoi(EARGF(usage()));
+		if(ninflight < 1)
+			usage();
+		break;
+	case 'L':
+		ninelatency = atoi(EARGF(usage()));
+		if(ninelatency < 0)
+			usage();
+		break;
+	case 'j':
+		nscanprocs = atoi(EARGF(usage()));
+		if(nscanprocs < 1 || nscanprocs > MAX_SCANPROCS)
+			usage();
+		break;
+	case 'r':
+		rfile = EARGF(usage());
+		break;
+	case 'e':
+		if(exportformat(EARGF(usage())) < 0)
+			usage();
+		export = 1;
+		break;
+	case 'm':
+		membudget = parsesize(EARGF(usage()));
+		if(membudget <= 0)
+			usage();
+		break;
+	case 'l':
+		scandepth = atoi(EARGF(usage()));
+		if(scandepth < 1)
+			usage();
+		break;
+	case 'p':
+		stream = 1;
+		break;
+	case 'd':
+		reportdepth = atoi(EARGF(usage()));
+		if(reportdepth < 0)
+			usage();
+		break;
+	case 's':
+		reportmin = parsesize(EARGF(usage()));
+		if(reportmin < 0)
+			usage();
+		break;
+	case 't':
+		ntop = atoi(EARGF(usage()));
+		if(ntop < 1 || ntop > MAX_TOP)
+			usage();
+		report = 1;
+		break;
+	case 'w':
+		wfile = EARGF(usage());
+		break;
 	default:
 		usage();
 	} ARGEND;
 	
-	if(argc > 1)
+	if(argc > 1 || (rfile != nil && (wfile != nil || report || stream || export || membudget > 0 || scandepth > 0 || addr != nil || gen != nil || argc > 0)))
+		usage();
+	if(addr != nil && gen != nil)
+		usage();
+	if(export && (wfile != nil || report || stream))
 		usage();
 	
+	/* A file server read over 9P keeps ninflight requests going,
+	 * each proc having a few of its own at a time */
+	if(nscanprocs == 0 && addr != nil)
+		nscanprocs = ninflight < MAX_SCANPROCS ? ninflight : MAX_SCANPROCS;
+	
+	/* Default to one scanner proc per processor */
+	if(nscanprocs == 0) {
+		s = getenv("NPROC");
+		if(s != nil)
+			nscanprocs = atoi(s);
+		free(s);
+		if(nscanprocs < 1)
+			nscanprocs = 1;
+		if(nscanprocs > MAX_SCANPROCS)
+			nscanprocs = MAX_SCANPROCS;
+	}
+	
+	/* Read a file server's tree over 9P ourselves, from its root
+	 * unless told otherwise */
+	if(addr != nil) {
+		scansource = ninesource(addr);
+		if(scansource == nil)
+			sysfatal("can't attach to %s: %r", addr);
+		path = "/";
+	}
+	
+	/* Or make a tree up */
+	if(gen != nil) {
+		scansource = synthsource(gen);
+		if(scansource == nil)
+			sysfatal("%r");
+		path = "/";
+	}
+	
 	if(argc == 1)
 		path = argv[0];
 	
+	if(bench) {
+		runbench(path);
+		if(exit_stats)
+			printstats(2, nil, nil);
+		threadexitsall(nil);
+	}
+	
+	/* Scan without a window, to print or export the tree as it is
+	 * read, save it for later or report the largest files and
+	 * directories. The display is never opened. */
+	if(wfile != nil || report || stream || export) {
+		if(stream) {
+			startreport();
+			dirdone = dureport;
+		}
+		if(export) {
+			startreport();
+			dirdone = exportdir;
+			filedone = exportfile;
+		}
+		
+		/* Only the snapshot and the largest files need file nodes */
+		if(wfile == nil && !report)
+			keepfiles = 0;
+		tree = newarena();
+		root = create_fsnode(tree, path, 0, 1, nil);
+		sc = startscan(tree, path, root, nil, nscanprocs, nil);
+		waitscan(sc, -1);
+		scantop(sc, &topfiles, &topdirs);
+		endscan(sc);
+		if(stream || export)
+			endreport();
+		if(wfile != nil && writesnap(root, wfile) < 0)
+			sysfatal("can't write %s: %r", wfile);
+		if(report)
+			print_top();
+		if(exit_stats)
+			printstats(2, nil, tree);
+		threadexitsall(nil);
+	}
+	
 	setup_draw();
 	
-	/* Initialize and scan the root directory */
-	open_directory(path);
+	scanc = chancreate(sizeof(ScanMsg), 4);
+	if(scanc == nil)
+		sysfatal("chancreate failed: %r");
+	
+	alts[AMOUSE].c = mctl->c;
+	alts[AMOUSE].v = &m;
+	alts[AMOUSE].op = CHANRCV;
+	alts[ARESIZE].c = mctl->resizec;
+	alts[ARESIZE].v = nil;
+	alts[ARESIZE].op = CHANRCV;
+	alts[AKBD].c = kctl->c;
+	alts[AKBD].v = &r;
+	alts[AKBD].op = CHANRCV;
+	alts[ASCAN].c = scanc;
+	alts[ASCAN].v = &sm;
+	alts[ASCAN].op = CHANRCV;
+	alts[AEND].op = CHANEND;
+	
+	/* Start scanning the root directory, or browse a saved one */
+	if(rfile != nil) {
+		if(open_snapshot(rfile) < 0)
+			sysfatal("can't read %s: %r", rfile);
+	} else
+		open_directory(path);
 	
 	/* Draw the UI immediately */
 	draw_ui();
 	
 	/* Main event loop */
 	for(;;) {
-		/* Wait for an event */
-		switch(event(&ev)) {
-		case Emouse:
-			/* Handle mouse events */
-			if(ev.mouse.buttons & 1) {
-				/* Left click in list view */
-				int list_idx = find_list_item_at_point(ev.mouse.xy);
-				if(list_idx >= -2) {
-					/* Update selection */
-					selected_list_idx = list_idx;
-					
-					/* Handle click on ".." */
-					if(list_idx == -2) {
-						navigate_up();
-					}
-					/* Handle double-click to navigate */
-					else if(list_idx >= 0 && current->children[list_idx]->isdir) {
-						/* TODO: proper double-click detection */
-						navigate_to_selected();
-					}
-					draw_ui();
-				}
-				
-				/* Left click in treemap view */
-				else if(ptinrect(ev.mouse.xy, treemap_rect)) {
-					FsNode *clicked = find_node_at_point(current, ev.mouse.xy);
-					if(clicked != nil) {
-						/* If clicked node is a direct child of current, select it */
-						if(clicked->parent == current) {
-							/* Find index of clicked node in current's children */
-							int i;
-							for(i = 0; i < current->nchildren; i++) {
-								if(current->children[i] == clicked) {
-									selected_list_idx = i;
-									
-									/* Adjust scroll to show selected item */
-									if(selected_list_idx < scroll_offset)
-										scroll_offset = selected_list_idx;
-									else if(selected_list_idx >= scroll_offset + visible_items)
-										scroll_offset = selected_list_idx - visible_items + 1;
-									
-									break;
-								}
-							}
-						}
-						/* If it's a descendant, navigate to its parent directory */
-						else if(clicked->parent != nil) {
-							FsNode *target = clicked;
-							int i;
-							
-							/* Navigate to the parent of the clicked node */
-							current = clicked->parent;
-							
-							/* Find the index of the clicked node in its parent's children */
-							for(i = 0; i < current->nchildren; i++) {
-								if(current->children[i] == target) {
-									selected_list_idx = i;
-									break;
-								}
-							}
-							
-							/* Adjust scroll to show selected item */
-							if(selected_list_idx < scroll_offset)
-								scroll_offset = selected_list_idx;
-							else if(selected_list_idx >= scroll_offset + visible_items)
-								scroll_offset = selected_list_idx - visible_items + 1;
-							
-							/* Update status message */
-							update_status("Current: %s (%s)", current->path, format_size(current->size));
-						}
-						
-						draw_ui();
-					}
-				}
-			}
+		switch(alt(alts)) {
+		case AMOUSE:
+			handle_mouse(&m);
+			break;
+			
+		case ARESIZE:
+			resized();
 			break;
 			
-		case Ekeyboard:
-			handle_key(ev.kbdc);
+		case AKBD:
+			handle_key(r);
+			break;
+			
+		case ASCAN:
+			handle_scan(&sm);
 			break;
 		}
 	}
-} 
\ No newline at end of file
+}
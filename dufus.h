@@ -10,21 +10,167 @@ enum {
 #define MB (KB*1024ULL)
 #define GB (MB*1024ULL)
 
-/* Structure for file/directory information */
+/* Scanner limits */
+enum {
+	MAX_SCANPROCS = 256,   /* Upper bound for -j */
+	SCAN_TICK = 250,       /* Milliseconds between progress messages */
+	NTOP_DEFAULT = 50,     /* Largest files and directories a scan keeps */
+	MAX_TOP = 100000       /* Upper bound for -t */
+};
+
+/* Treemap drawing, shared with the benchmarks */
+enum {
+	LABEL_THRESHOLD = 40,  /* Minimum size to show text labels */
+	MAX_DEPTH_LEVEL = 8    /* Maximum recursion depth to visualize differently */
+};
+
+/* Structure for file/directory information. This is the core tree
+ * node and is kept small: names live in the shared pool (intern.c),
+ * full paths are rebuilt from the parent chain with %N, and display
+ * state such as rectangles lives with the treemap layout. */
 typedef struct FsNode {
-	char name[256];
-	char path[1024];
-	u64int size;
-	int isdir;
+	char *name;        /* Pooled; the root's name is the scanned path */
 	struct FsNode *parent;
 	struct FsNode **children;
+	u64int size;
 	int nchildren;
 	int maxchildren;
-	Rectangle bounds;  /* Display rectangle */
-	Image *color;      /* Display color */
-	int id;            /* Unique ID for this node */
+	int nsorted;       /* Leading children known to be in size order */
+	u32int sortgen;    /* sizegen when they were, else nsorted is stale */
+	u32int vers;       /* qid.vers and mtime when scanned, to spot */
+	u32int mtime;      /* directories that have changed since */
+	uchar isdir;
+	uchar alias;       /* Directory reached by another path, not read here */
+	uchar lazy;        /* Children not read from the snapshot yet;
+	                    * maxchildren holds the node's record there */
+	uchar folded;      /* Summary of entries not kept, to stay within
+	                    * the memory budget; vers is how many */
+	uchar pruned;      /* Below the depth limit, so only its size was read;
+	                    * maxchildren is how many entries are below it */
 } FsNode;
 
+/* Scan trees are allocated in arenas (see arena.c) */
+typedef struct Arena Arena;
+
+/* Memory held by a tree, for reporting */
+typedef struct TreeStats {
+	long nodes;
+	vlong nodebytes;   /* FsNode structures */
+	vlong childbytes;  /* Children arrays */
+	vlong wastebytes;  /* Children arrays abandoned when they grew */
+	long chunks;       /* Arena chunks */
+	vlong chunkbytes;  /* Memory held by the arena, including unused space */
+	vlong namebytes;   /* Name pool, shared by all trees */
+	long names;        /* Distinct pooled names */
+} TreeStats;
+
+/* Phases timed for the stats overlay and -S. The scanner procs time
+ * the first three, the main proc the rest. */
+enum {
+	PHASE_OPEN,
+	PHASE_DIRREAD,
+	PHASE_NODES,       /* Making nodes of what was read */
+	PHASE_SORT,
+	PHASE_LAYOUT,
+	PHASE_DRAW,
+	PHASE_FLUSH,
+	NPHASE,
+	NSCANPHASE = PHASE_SORT
+};
+
+enum {
+	STATS_LINES = 16,
+	STATS_LINELEN = 96
+};
+
+typedef struct Stats {
+	vlong ns[NPHASE];  /* Time spent in each phase */
+	long n[NPHASE];    /* Times each was entered */
+	long ndirs;        /* Directories listed by finished scans */
+	long nentries;     /* Entries they held */
+	vlong scanns;      /* How long those scans ran */
+	long frames;
+	vlong framens;     /* How long the last frame took */
+	long drawn;        /* Nodes drawn in the last frame */
+	long drawing;      /* Nodes drawn so far in this one */
+} Stats;
+
+/* A rectangle of the treemap layout */
+typedef struct Tile {
+	FsNode *node;
+	int index;         /* Of node in its parent's children; for a block, its first child */
+	Rectangle r;
+	int depth;         /* Nesting level below the current directory */
+	int top;           /* Index of the current directory's child it belongs to */
+	int nrest;         /* If not 0, the block for node's last nrest children */
+} Tile;
+
+/* The largest nodes seen, as a bounded min-heap (see top.c) */
+typedef struct TopEnt {
+	u64int size;
+	FsNode *node;      /* Or nil, for something folded or pruned ... */
+	char *path;        /* ... which is known by its path */
+} TopEnt;
+
+typedef struct Top {
+	TopEnt *ent;
+	int n;
+	int max;
+} Top;
+
+/* A parallel scan in progress (see scan.c) */
+typedef struct Worker Worker;
+typedef struct Visited Visited;
+/* Where a scan reads directories from. Directories are opened by
+ * path, and stat returns nil with the error set, as dirstat. */
+typedef struct Source Source;
+struct Source {
+	char *name;
+	void* (*open)(Source *src, char *path);
+	long (*dirread)(void *dir, Dir **d);
+	void (*close)(void *dir);
+	Dir* (*stat)(Source *src, char *path);
+	void *aux;
+};
+
+typedef struct Scan Scan;
+struct Scan {
+	Worker *workers;
+	int nworkers;
+	Arena *tree;       /* Arena the scanned nodes belong to */
+	FsNode *root;      /* Node the scan fills in */
+	FsNode *old;       /* Earlier scan being refreshed, or nil */
+	Arena *oldtree;    /* Left for the owner: where old lives */
+	Channel *c;        /* Progress messages, or nil */
+	Source *src;       /* Where directories are read from */
+	Visited *visited;  /* Directories reached so far */
+	int cancel;        /* Set to stop listing directories */
+	int done;          /* Set once the root directory has rolled up */
+	char err[ERRMAX];  /* Why the root directory could not be opened */
+	long nidle;        /* Workers waiting for work */
+	long wake;         /* Semaphore idle workers sleep on */
+	long running;      /* Scanner procs that have not exited */
+	long finished;     /* Semaphore released when the last proc exits */
+	int finished_seen;
+	vlong start;       /* When it started, for the stats */
+};
+
+/* A tree snapshot read back from disk (see snapshot.c) */
+typedef struct Snap {
+	Arena *tree;       /* Where the file and its nodes are kept */
+	uchar *nodes;      /* Node records */
+	ulong nnodes;
+	char *names;       /* String table */
+	ulong namebytes;
+	FsNode *root;
+} Snap;
+
+/* Sent by a scan to its channel while it runs and when it is over */
+typedef struct ScanMsg {
+	Scan *scan;
+	int done;
+} ScanMsg;
+
 /* Global variables */
 extern int mode;
 extern FsNode *root;
@@ -36,6 +182,10 @@ extern Rectangle maprect;
 extern Point viewport;
 extern Point pan_start;
 extern int panning;
+extern int nscanprocs;
+extern int ntop;
+extern ulong treegen;
+extern ulong sizegen;
 
 /* Colors */
 extern Image *back;    /* Background */
@@ -56,7 +206,13 @@ extern Image *depth_colors[8];
 /* Utility functions */
 int min(int a, int b);
 char* format_size(u64int size);
+vlong parsesize(char *s);
+
+/* Fitting label text (see text.c) */
+int textwidth(Font *f, char *s);
 void truncate_string(char *s, Font *f, int max_width);
+char* nodelabel(FsNode *node, Font *f, int max_width);
+void subfontwidths(Font *f, Fontchar *info, int n);
 
 /* Drawing functions */
 void setup_draw(void);
@@ -65,20 +221,110 @@ void calculate_layout(void);
 void draw_header(void);
 void draw_footer(void);
 void draw_treemap(void);
-void draw_node(FsNode *node, int highlight_it);
-void draw_node_recursive_contents(FsNode *node);
+void draw_file_list(void);
+void draw_splitter(void);
+void draw_node(Image *dst, Tile *t, int highlight_it);
 void draw_ui(void);
-void layout_treemap(FsNode *node, Rectangle avail, int depth);
-void layout_horizontal(FsNode *node, Rectangle avail, double total_size);
-void layout_vertical(FsNode *node, Rectangle avail, double total_size);
+void redraw(int damage);
+void draw_top_panel(void);
+void select_item(int index);
+void select_row(int index);
+int list_rows(void);
+void scroll_to(int index);
+void scroll_list(int delta);
+void draw_parent_item(void);
+void layout_treemap(FsNode *node, Rectangle avail, int depth, int top);
+int layout_current(Rectangle r);
+extern Tile *tiles;
+extern int ntiles;
+void index_tiles(Rectangle r);
+int layout_horizontal(FsNode *node, Rectangle avail, double total_size, Rectangle *rects, Rectangle *rest);
+int layout_vertical(FsNode *node, Rectangle avail, double total_size, Rectangle *rects, Rectangle *rest);
 
 /* File system operations */
-FsNode* create_fsnode(char *name, char *path, u64int size, int isdir, FsNode *parent);
-void add_child(FsNode *parent, FsNode *child);
-void scan_directory(char *path, FsNode *parent);
-void clear_fsnode(FsNode *node);
+FsNode* create_fsnode(Arena *a, char *name, u64int size, int isdir, FsNode *parent);
+void add_child(Arena *a, FsNode *parent, FsNode *child);
+void scan_directory(Arena *tree, char *path, FsNode *parent);
+Scan* startscan(Arena *tree, char *path, FsNode *parent, FsNode *old, int nproc, Channel *c);
+int waitscan(Scan *s, int ms);
+void scanprogress(Scan *s, long *ndirs, long *nentries, long *nsame);
+void scanaliases(Scan *s, long *naliases, long *ndirs, vlong *nbytes);
+void scanfolded(Scan *s, long *nfolded, vlong *nbytes);
+void scantop(Scan *s, Top *files, Top *dirs);
+void scanphases(Scan *s, vlong *ns, long *n);
+extern void (*dirdone)(FsNode *dir, Qid qid, int depth, long nentries);
+extern void (*filedone)(FsNode *dir, Dir *d, int depth);
+extern int keepfiles;
+extern vlong membudget;
+extern int scandepth;
+extern Source *scansource;
+void cancelscan(Scan *s);
+void endscan(Scan *s);
 void sort_nodes_by_size(FsNode *parent);
+void sort_top_children(FsNode *parent, int k);
+void unsort_all(void);
 void open_directory(char *path);
+int open_snapshot(char *file);
+void refresh_tree(void);
+int nodefmt(Fmt *f);
+
+/* Arenas */
+Arena* newarena(void);
+Arena* subarena(Arena *parent);
+void freearena(Arena *a);
+FsNode* arenanode(Arena *a);
+void* arenaalloc(Arena *a, ulong n);
+void arenachildren(Arena *a, FsNode *parent, int n);
+void arenastats(Arena *a, TreeStats *ts);
+
+/* Reports without a window */
+extern int reportdepth;
+extern vlong reportmin;
+void startreport(void);
+void endreport(void);
+void dureport(FsNode *dir, Qid qid, int depth, long nentries);
+int exportformat(char *name);
+void exportdir(FsNode *dir, Qid qid, int depth, long nentries);
+void exportfile(FsNode *dir, Dir *d, int depth);
+
+/* Largest nodes */
+void topinit(Top *t, int max);
+void topfree(Top *t);
+int topwants(Top *t, u64int size);
+void topadd(Top *t, FsNode *node);
+void topaddpath(Top *t, u64int size, char *path);
+void topmerge(Top *dst, Top *src);
+void topsort(Top *t);
+void toppath(Top *t, int i, char *buf, int n);
+
+/* 9P file servers */
+extern int ninflight;
+extern int ninelatency;
+Source* ninesource(char *addr);
+
+/* Stats */
+extern Stats stats;
+void phasebegin(int phase);
+void phaseend(void);
+void framebegin(void);
+void frameend(void);
+int statslines(Scan *s, Arena *tree, char (*line)[STATS_LINELEN]);
+void printstats(int fd, Scan *s, Arena *tree);
+
+/* Made-up trees */
+Source* synthsource(char *spec);
+
+/* Benchmarks */
+void runbench(char *dir);
+
+/* Snapshots */
+int writesnap(FsNode *root, char *file);
+Snap* readsnap(Arena *tree, char *file);
+void loadchildren(Snap *sn, FsNode *node);
+
+/* Name pool */
+char* intern(char *s);
+void internstats(long *nnames, long *nhits, vlong *nbytes);
 
 /* Navigation functions */
 void navigate(Rune key);
@@ -88,9 +334,10 @@ void navigate_to_selected(void);
 void update_status(char *fmt, ...);
 
 /* Event handling */
-void eresized(int new);
+void resized(void);
+void handle_scan(ScanMsg *m);
 
 /* Utility */
 void usage(void);
-FsNode* find_node_at_point(FsNode *node, Point p);
+Tile* find_tile_at_point(Point p);
 int find_list_item_at_point(Point p);
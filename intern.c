@@ -0,0 +1,175 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include "dufus.h"
+
+/*
+ * Shared pool of file names. Every distinct name is stored once and
+ * nodes point at the pooled copy, so the many repeated names in a tree
+ * (mkfile, README, a, b, ...) cost a pointer each. The pool is split
+ * into shards with their own locks so scanner procs rarely contend.
+ * Names are never freed; rescanning the same tree reuses them.
+ */
+
+enum {
+	NSHARD = 64,           /* Independent tables (power of two) */
+	SHARD_INIT = 256,      /* Initial buckets per shard (power of two) */
+	NAMEBLOCK = 64*1024    /* Bytes of name storage allocated at a time */
+};
+
+typedef struct Name Name;
+typedef struct Shard Shard;
+
+struct Name {
+	Name *next;
+	ulong hash;
+	char s[1];
+};
+
+struct Shard {
+	Lock;
+	Name **tab;
+	ulong ntab;
+	ulong nname;
+	ulong nhit;            /* Lookups that found an existing name */
+	char *blk;             /* Current storage block */
+	ulong blkleft;
+	vlong nbytes;          /* Storage and table bytes held by the shard */
+};
+
+static Shard shards[NSHARD];
+
+/* FNV-1a */
+static ulong
+hashname(char *s, int *len)
+{
+	ulong h;
+	char *p;
+
+	h = 2166136261UL;
+	for(p = s; *p != '\0'; p++) {
+		h ^= (uchar)*p;
+		h *= 16777619UL;
+	}
+	*len = p - s;
+
+	return h;
+}
+
+/* Carve storage for a name of len bytes out of the shard's block */
+static Name*
+allocname(Shard *sh, int len)
+{
+	ulong n;
+	Name *nm;
+
+	n = offsetof(Name, s[0]) + len + 1;
+	n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+	if(n > NAMEBLOCK / 4) {
+		/* Long names get their own allocation */
+		nm = malloc(n);
+		if(nm == nil)
+			sysfatal("malloc failed: %r");
+		sh->nbytes += n;
+		return nm;
+	}
+
+	if(n > sh->blkleft) {
+		sh->blk = malloc(NAMEBLOCK);
+		if(sh->blk == nil)
+			sysfatal("malloc failed: %r");
+		sh->blkleft = NAMEBLOCK;
+		sh->nbytes += NAMEBLOCK;
+	}
+
+	nm = (Name*)sh->blk;
+	sh->blk += n;
+	sh->blkleft -= n;
+
+	return nm;
+}
+
+/* Double a shard's hash table */
+static void
+growshard(Shard *sh)
+{
+	Name **tab, *nm, *next;
+	ulong i, ntab, b;
+
+	ntab = sh->ntab == 0 ? SHARD_INIT : sh->ntab * 2;
+	tab = mallocz(ntab * sizeof(Name*), 1);
+	if(tab == nil)
+		sysfatal("malloc failed: %r");
+
+	for(i = 0; i < sh->ntab; i++) {
+		for(nm = sh->tab[i]; nm != nil; nm = next) {
+			next = nm->next;
+			b = (nm->hash / NSHARD) & (ntab - 1);
+			nm->next = tab[b];
+			tab[b] = nm;
+		}
+	}
+
+	sh->nbytes += (ntab - sh->ntab) * sizeof(Name*);
+	free(sh->tab);
+	sh->tab = tab;
+	sh->ntab = ntab;
+}
+
+/* Return the pooled copy of s, adding it if necessary */
+char*
+intern(char *s)
+{
+	Shard *sh;
+	Name *nm;
+	ulong h, b;
+	int len;
+
+	h = hashname(s, &len);
+	sh = &shards[h & (NSHARD - 1)];
+
+	lock(sh);
+	if(sh->tab == nil)
+		growshard(sh);
+
+	b = (h / NSHARD) & (sh->ntab - 1);
+	for(nm = sh->tab[b]; nm != nil; nm = nm->next) {
+		if(nm->hash == h && strcmp(nm->s, s) == 0) {
+			sh->nhit++;
+			unlock(sh);
+			return nm->s;
+		}
+	}
+
+	nm = allocname(sh, len);
+	nm->hash = h;
+	memmove(nm->s, s, len + 1);
+	nm->next = sh->tab[b];
+	sh->tab[b] = nm;
+
+	if(++sh->nname > sh->ntab)
+		growshard(sh);
+	unlock(sh);
+
+	return nm->s;
+}
+
+/* Report the size of the name pool */
+void
+internstats(long *nnames, long *nhits, vlong *nbytes)
+{
+	Shard *sh;
+
+	*nnames = 0;
+	*nhits = 0;
+	*nbytes = 0;
+	for(sh = shards; sh < shards + NSHARD; sh++) {
+		lock(sh);
+		*nnames += sh->nname;
+		*nhits += sh->nhit;
+		*nbytes += sh->nbytes;
+		unlock(sh);
+	}
+}
@@ -0,0 +1,677 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include <fcall.h>
+#include "dufus.h"
+
+/*
+ * A scan source that talks 9P to a file server directly, rather than
+ * through a mount. Every scanner proc sends its walks, opens, reads
+ * and clunks down one connection without waiting for anyone else's
+ * replies. A reader proc hands each reply to the request with its
+ * tag, so up to ninflight requests are outstanding at once. The time
+ * a scan takes then depends on how fast the server can answer, not
+ * on how far away it is.
+ *
+ * A proc does not wait between its own requests either, where it can
+ * help it. A directory's walk, open and first read are sent together,
+ * so most directories cost one round trip and the read that finds
+ * their end. A server that answers out of order may fail the open or
+ * the read, finding the fid not yet walked or opened; they are then
+ * sent again, one at a time. Clunks are not waited for at all.
+ *
+ * ninelatency holds every request back before it is sent, so a server
+ * on this machine, such as a ramfs(4) posted in /srv, can stand in for
+ * a distant one.
+ */
+
+enum {
+	MSIZE = 8192 + IOHDRSZ,    /* Largest message we ask for */
+	MAX_INFLIGHT = 1024,       /* Tags, at most */
+	READER_STACK = 16*1024,
+	ROOTFID = 0
+};
+
+int ninflight = 64;            /* Requests outstanding at once */
+int ninelatency;               /* Milliseconds each request is held back */
+
+typedef struct Conn Conn;
+typedef struct Req Req;
+typedef struct Fid Fid;
+
+/* A request waiting for its reply */
+struct Req {
+	Fcall r;
+	uchar *buf;                /* Where r's strings and data are */
+	char *err;                 /* Set if the reply can never come */
+	long done;                 /* Released when it has */
+	ushort tag;
+	int async;                 /* Nobody waits: the reply is thrown away */
+};
+
+struct Conn {
+	Lock;                      /* Protects req and free */
+	int fd;
+	uint msize;
+	Req **req;                 /* Outstanding requests by tag */
+	ushort *free;              /* Tags not in use */
+	int nfree;
+	long tags;                 /* Semaphore counting them */
+	QLock reserving;           /* Held while taking tags */
+	long nextfid;
+	Lock wlock;                /* Whole messages are written at a time */
+	int dead;                  /* The connection is gone */
+};
+
+/* An open directory */
+struct Fid {
+	Conn *c;
+	u32int fid;
+	vlong offset;
+	Req *first;                /* The first read, sent with the open */
+};
+
+/* Take r out of its slot, giving back its tag; returns 0 if someone
+ * else already has. Whoever empties the slot gives back the tag, so
+ * it goes back once however the request ends. Call with c locked,
+ * and semrelease c->tags if 1 is returned. */
+static int
+untag(Conn *c, Req *r)
+{
+	if(c->req[r->tag] != r)
+		return 0;
+	c->req[r->tag] = nil;
+	c->free[c->nfree++] = r->tag;
+	return 1;
+}
+
+/* Deliver replies to whoever is waiting for them */
+static void
+readproc(void *v)
+{
+	Conn *c;
+	Fcall f;
+	Req *r;
+	uchar *buf;
+	int i, n;
+
+	c = v;
+	for(;;) {
+		buf = malloc(c->msize);
+		if(buf == nil)
+			sysfatal("malloc failed: %r");
+		n = read9pmsg(c->fd, buf, c->msize);
+		if(n <= 0 || convM2S(buf, n, &f) != n)
+			break;
+
+		lock(c);
+		r = nil;
+		if(f.tag < ninflight && c->req[f.tag] != nil) {
+			r = c->req[f.tag];
+			untag(c, r);
+		}
+		unlock(c);
+		if(r == nil) {
+			free(buf);
+			continue;
+		}
+		semrelease(&c->tags, 1);
+		if(r->async) {
+			free(buf);
+			free(r);
+			continue;
+		}
+		r->r = f;
+		r->buf = buf;
+		semrelease(&r->done, 1);
+	}
+	free(buf);
+
+	/* Nothing more will come; fail everything still waiting, as
+	 * though it had been answered */
+	lock(&c->wlock);
+	c->dead = 1;
+	unlock(&c->wlock);
+	lock(c);
+	for(i = 0; i < ninflight; i++) {
+		r = c->req[i];
+		if(r == nil)
+			continue;
+		untag(c, r);
+		semrelease(&c->tags, 1);
+		if(r->async)
+			free(r);
+		else {
+			r->err = "connection to file server lost";
+			semrelease(&r->done, 1);
+		}
+	}
+	unlock(c);
+}
+
+/* Set aside n tags for requests about to be sent. Procs take them
+ * one proc at a time, in turn, so that they cannot each hold some and
+ * all wait for more, and a proc wanting several is not passed over by
+ * those wanting one. */
+static void
+reserve(Conn *c, int n)
+{
+	int i;
+
+	qlock(&c->reserving);
+	for(i = 0; i < n; i++)
+		semacquire(&c->tags, 1);
+	qunlock(&c->reserving);
+}
+
+/* Send t, to be answered in r, on a tag set aside by reserve; returns
+ * -1 with r->err set if it could not be. If the connection is lost
+ * meanwhile, r may already have been failed as though answered, and
+ * freed if async; then 0 is returned and r must be left alone. */
+static int
+sendreq(Conn *c, Fcall *t, Req *r)
+{
+	uchar *buf;
+	uint n;
+	int ok;
+
+	lock(c);
+	r->tag = c->free[--c->nfree];
+	c->req[r->tag] = r;
+	unlock(c);
+	t->tag = r->tag;
+
+	buf = malloc(c->msize);
+	if(buf == nil)
+		sysfatal("malloc failed: %r");
+	n = convS2M(t, buf, c->msize);
+	lock(&c->wlock);
+	ok = n > 0 && !c->dead && write(c->fd, buf, n) == n;
+	unlock(&c->wlock);
+	free(buf);
+
+	if(!ok) {
+		lock(c);
+		ok = !untag(c, r);
+		if(!ok)
+			r->err = "can't write to file server";
+		unlock(c);
+		if(!ok) {
+			semrelease(&c->tags, 1);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Wait for the reply in r to t, sent by sendreq; returns -1 with the
+ * error set. On success free r->buf once done with the reply. */
+static int
+waitreq(Fcall *t, Req *r)
+{
+	if(r->err == nil)
+		semacquire(&r->done, 1);
+
+	if(r->err != nil) {
+		werrstr("%s", r->err);
+		return -1;
+	}
+	if(r->r.type == Rerror) {
+		werrstr("%s", r->r.ename);
+		free(r->buf);
+		return -1;
+	}
+	if(r->r.type != t->type + 1) {
+		werrstr("unexpected reply type %d to %d", r->r.type, t->type);
+		free(r->buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Hold back a round trip to stand in for a distant server */
+static void
+delay(void)
+{
+	if(ninelatency > 0)
+		sleep(ninelatency);
+}
+
+/* Send t and wait for the reply in r; returns -1 with the error set.
+ * On success free r->buf once done with the reply. */
+static int
+rpc(Conn *c, Fcall *t, Req *r)
+{
+	delay();
+	memset(r, 0, sizeof(Req));
+	reserve(c, 1);
+	sendreq(c, t, r);
+	return waitreq(t, r);
+}
+
+/* Let fid go, without waiting to hear that it has */
+static void
+clunk(Conn *c, u32int fid)
+{
+	Fcall t;
+	Req *r;
+
+	r = mallocz(sizeof(Req), 1);
+	if(r == nil)
+		sysfatal("malloc failed: %r");
+	r->async = 1;
+	t.type = Tclunk;
+	t.fid = fid;
+	reserve(c, 1);
+	if(sendreq(c, &t, r) < 0)
+		free(r);
+}
+
+/* The names to walk to path, in *elem; free it and *s when done */
+static int
+splitpath(char *path, char ***elem, char **s)
+{
+	int i, n, nelem;
+
+	*s = strdup(path);
+	nelem = 1;
+	for(i = 0; *s != nil && (*s)[i] != '\0'; i++)
+		if((*s)[i] == '/')
+			nelem++;
+	*elem = malloc(nelem * sizeof(char*));
+	if(*s == nil || *elem == nil)
+		sysfatal("malloc failed: %r");
+	nelem = getfields(*s, *elem, nelem, 1, "/");
+
+	/* "." is where we are already */
+	for(i = n = 0; i < nelem; i++)
+		if(strcmp((*elem)[i], ".") != 0 && (*elem)[i][0] != '\0')
+			(*elem)[n++] = (*elem)[i];
+
+	return n;
+}
+
+/* Walk a new fid to path, below the attach point; returns it, or
+ * NOFID with the error set */
+static u32int
+walk(Conn *c, char *path)
+{
+	Fcall t;
+	Req r;
+	char *s, **elem;
+	u32int fid;
+	int i, n, nelem, walked;
+
+	nelem = splitpath(path, &elem, &s);
+	fid = ainc(&c->nextfid);
+	t.type = Twalk;
+	t.fid = ROOTFID;
+	t.newfid = fid;
+	walked = 0;
+	i = 0;
+	do {
+		/* At most MAXWELEM names to a message */
+		n = nelem - i;
+		if(n > MAXWELEM)
+			n = MAXWELEM;
+		t.nwname = n;
+		memmove(t.wname, elem + i, n * sizeof(char*));
+		if(rpc(c, &t, &r) < 0)
+			break;
+		free(r.buf);
+		if(r.r.nwqid != n) {
+			werrstr("'%s' does not exist", path);
+			break;
+		}
+		walked = 1;
+		i += n;
+		t.fid = fid;
+	} while(i < nelem);
+	free(elem);
+	free(s);
+
+	if(i < nelem || (nelem == 0 && !walked)) {
+		if(walked)
+			clunk(c, fid);
+		return NOFID;
+	}
+
+	return fid;
+}
+
+/* Open fid, one round trip on its own; returns -1 with the error set */
+static int
+openfid(Conn *c, u32int fid)
+{
+	Fcall t;
+	Req r;
+
+	t.type = Topen;
+	t.fid = fid;
+	t.mode = OREAD;
+	if(rpc(c, &t, &r) < 0)
+		return -1;
+	free(r.buf);
+	return 0;
+}
+
+static void*
+nineopen(Source *src, char *path)
+{
+	Conn *c;
+	Fcall tw, to, tr;
+	Req rw, ro, *rr;
+	Fid *f;
+	char *s, **elem, err[ERRMAX];
+	u32int fid;
+	int nelem, walked, opened;
+
+	c = src->aux;
+	f = mallocz(sizeof(Fid), 1);
+	if(f == nil)
+		sysfatal("malloc failed: %r");
+	f->c = c;
+
+	/* A path too long for one walk goes a step at a time, as does
+	 * everything if there are too few tags to send three at once */
+	nelem = splitpath(path, &elem, &s);
+	if(nelem > MAXWELEM || ninflight < 3) {
+		free(elem);
+		free(s);
+		f->fid = walk(c, path);
+		if(f->fid == NOFID || openfid(c, f->fid) < 0) {
+			if(f->fid != NOFID)
+				clunk(c, f->fid);
+			free(f);
+			return nil;
+		}
+		return f;
+	}
+
+	/* Otherwise the walk, open and first read go out together */
+	fid = ainc(&c->nextfid);
+	tw.type = Twalk;
+	tw.fid = ROOTFID;
+	tw.newfid = fid;
+	tw.nwname = nelem;
+	memmove(tw.wname, elem, nelem * sizeof(char*));
+	to.type = Topen;
+	to.fid = fid;
+	to.mode = OREAD;
+	tr.type = Tread;
+	tr.fid = fid;
+	tr.offset = 0;
+	tr.count = c->msize - IOHDRSZ;
+	rr = mallocz(sizeof(Req), 1);
+	if(rr == nil)
+		sysfatal("malloc failed: %r");
+	memset(&rw, 0, sizeof(Req));
+	memset(&ro, 0, sizeof(Req));
+
+	delay();
+	reserve(c, 3);
+	sendreq(c, &tw, &rw);
+	sendreq(c, &to, &ro);
+	sendreq(c, &tr, rr);
+	free(elem);
+	free(s);
+
+	walked = waitreq(&tw, &rw) == 0;
+	if(walked) {
+		free(rw.buf);
+		if(rw.r.nwqid != nelem) {
+			werrstr("'%s' does not exist", path);
+			walked = 0;
+		}
+	}
+	if(!walked)
+		rerrstr(err, sizeof(err));
+	opened = waitreq(&to, &ro) == 0;
+	if(opened)
+		free(ro.buf);
+	if(waitreq(&tr, rr) == 0)
+		f->first = rr;
+	else
+		free(rr);
+
+	if(!walked) {
+		if(f->first != nil) {
+			free(f->first->buf);
+			free(f->first);
+		}
+		free(f);
+		werrstr("%s", err);
+		return nil;
+	}
+
+	/* Sent before the walk was done, the open may have found no fid;
+	 * and the read, no open one. Then they go again, in turn. */
+	f->fid = fid;
+	if(!opened && openfid(c, fid) < 0) {
+		clunk(c, fid);
+		free(f);
+		return nil;
+	}
+
+	return f;
+}
+
+/* Unpack n bytes of directory entries into one allocation, as dirread */
+static long
+unpackdirs(uchar *buf, long n, Dir **dp)
+{
+	Dir *d;
+	char *s;
+	long i, m, nd;
+
+	nd = 0;
+	for(i = 0; i + BIT16SZ <= n; i += m) {
+		m = BIT16SZ + GBIT16(buf + i);
+		if(statcheck(buf + i, m) < 0)
+			break;
+		nd++;
+	}
+	if(nd == 0) {
+		werrstr("bad directory entry from file server");
+		return -1;
+	}
+
+	/* Each entry's strings fit in the bytes it came in */
+	d = malloc(nd * sizeof(Dir) + n);
+	if(d == nil)
+		sysfatal("malloc failed: %r");
+	s = (char*)(d + nd);
+	for(i = 0, m = 0; m < nd; m++) {
+		convM2D(buf + i, BIT16SZ + GBIT16(buf + i), &d[m], s);
+		s += BIT16SZ + GBIT16(buf + i);
+		i += BIT16SZ + GBIT16(buf + i);
+	}
+
+	*dp = d;
+	return nd;
+}
+
+static long
+ninedirread(void *dir, Dir **d)
+{
+	Fid *f;
+	Fcall t;
+	Req r;
+	long n;
+
+	f = dir;
+	if(f->first != nil) {
+		r = *f->first;
+		free(f->first);
+		f->first = nil;
+	} else {
+		t.type = Tread;
+		t.fid = f->fid;
+		t.offset = f->offset;
+		t.count = f->c->msize - IOHDRSZ;
+		if(rpc(f->c, &t, &r) < 0)
+			return -1;
+	}
+
+	f->offset += r.r.count;
+	n = 0;
+	if(r.r.count > 0)
+		n = unpackdirs((uchar*)r.r.data, r.r.count, d);
+	free(r.buf);
+
+	return n;
+}
+
+static void
+nineclose(void *dir)
+{
+	Fid *f;
+
+	f = dir;
+	if(f->first != nil) {
+		free(f->first->buf);
+		free(f->first);
+	}
+	clunk(f->c, f->fid);
+	free(f);
+}
+
+static Dir*
+ninestat(Source *src, char *path)
+{
+	Conn *c;
+	Fcall t;
+	Req r;
+	Dir *d;
+	u32int fid;
+
+	c = src->aux;
+	fid = walk(c, path);
+	if(fid == NOFID)
+		return nil;
+
+	t.type = Tstat;
+	t.fid = fid;
+	d = nil;
+	if(rpc(c, &t, &r) == 0) {
+		d = malloc(sizeof(Dir) + r.r.nstat);
+		if(d == nil)
+			sysfatal("malloc failed: %r");
+		if(convM2D(r.r.stat, r.r.nstat, d, (char*)(d + 1)) != r.r.nstat) {
+			werrstr("bad stat from file server");
+			free(d);
+			d = nil;
+		}
+		free(r.buf);
+	}
+	clunk(c, fid);
+
+	return d;
+}
+
+/* Agree on a version and message size before anything else is sent */
+static int
+version(Conn *c)
+{
+	Fcall f;
+	uchar *buf;
+	int n;
+
+	buf = malloc(c->msize);
+	if(buf == nil)
+		sysfatal("malloc failed: %r");
+	f.type = Tversion;
+	f.tag = NOTAG;
+	f.msize = c->msize;
+	f.version = VERSION9P;
+	n = convS2M(&f, buf, c->msize);
+	if(write(c->fd, buf, n) != n ||
+	   (n = read9pmsg(c->fd, buf, c->msize)) <= 0 || convM2S(buf, n, &f) != n) {
+		free(buf);
+		werrstr("version: %r");
+		return -1;
+	}
+	if(f.type != Rversion || strncmp(f.version, "9P2000", 6) != 0) {
+		werrstr("version: server does not speak 9P2000");
+		free(buf);
+		return -1;
+	}
+	if(f.msize < c->msize)
+		c->msize = f.msize;
+	free(buf);
+
+	return 0;
+}
+
+/* Connect to the file server at addr, a file posted in /srv or a
+ * network address, and attach to its tree; returns nil with the
+ * error set */
+Source*
+ninesource(char *addr)
+{
+	Source *src;
+	Conn *c;
+	Fcall t;
+	Req r;
+	int i;
+
+	if(ninflight < 1)
+		ninflight = 1;
+	if(ninflight > MAX_INFLIGHT)
+		ninflight = MAX_INFLIGHT;
+
+	c = mallocz(sizeof(Conn), 1);
+	if(c == nil)
+		sysfatal("malloc failed: %r");
+	if(addr[0] == '/' || strncmp(addr, "./", 2) == 0)
+		c->fd = open(addr, ORDWR);
+	else
+		c->fd = dial(netmkaddr(addr, "tcp", "9fs"), nil, nil, nil);
+	if(c->fd < 0) {
+		free(c);
+		return nil;
+	}
+
+	c->msize = MSIZE;
+	if(version(c) < 0) {
+		close(c->fd);
+		free(c);
+		return nil;
+	}
+
+	c->req = mallocz(ninflight * sizeof(Req*), 1);
+	c->free = malloc(ninflight * sizeof(ushort));
+	if(c->req == nil || c->free == nil)
+		sysfatal("malloc failed: %r");
+	for(i = 0; i < ninflight; i++)
+		c->free[i] = ninflight - 1 - i;
+	c->nfree = ninflight;
+	c->tags = ninflight;
+	c->nextfid = ROOTFID;
+
+	if(proccreate(readproc, c, READER_STACK) < 0)
+		sysfatal("proccreate: %r");
+
+	t.type = Tattach;
+	t.fid = ROOTFID;
+	t.afid = NOFID;
+	t.uname = getuser();
+	t.aname = "";
+	if(rpc(c, &t, &r) < 0)
+		return nil;
+	free(r.buf);
+
+	src = mallocz(sizeof(Source), 1);
+	if(src == nil)
+		sysfatal("malloc failed: %r");
+	src->name = addr;
+	src->open = nineopen;
+	src->dirread = ninedirread;
+	src->close = nineclose;
+	src->stat = ninestat;
+	src->aux = c;
+
+	return src;
+}
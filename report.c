@@ -0,0 +1,185 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include <bio.h>
+#include "dufus.h"
+
+/*
+ * Reports written to standard output without a window.
+ *
+ * For -p the scanner calls dureport() as each directory is complete,
+ * from whichever proc finished it. A directory's subdirectories are
+ * printed then, largest first, so every line comes after the lines
+ * for everything below it, as with du(1), and output appears while
+ * the rest of the tree is still being read. Nothing is kept for the
+ * report beyond the scanned tree itself.
+ *
+ * For -e every node becomes a record, as NDJSON or CSV. Files are
+ * written as their directory is listed, so the scan makes no nodes
+ * for them, and directories once they are complete, with their full
+ * size. Memory then grows with the number of directories, not the
+ * number of files.
+ */
+
+enum {
+	EXPORT_NDJSON = 1,
+	EXPORT_CSV
+};
+
+int reportdepth = 0x7FFFFFFF;   /* Deepest directories printed, the root being 0 */
+vlong reportmin = 0;            /* Smallest directory printed */
+
+static Biobuf bout;
+static Lock outlock;
+static int format;
+
+void
+startreport(void)
+{
+	Binit(&bout, 1, OWRITE);
+	if(format == EXPORT_CSV)
+		Bprint(&bout, "path,size,isdir,qidpath,qidvers,mtime,depth,entries\n");
+}
+
+void
+endreport(void)
+{
+	Bterm(&bout);
+}
+
+/* Print one directory, in kilobytes as du(1) does */
+static void
+reportline(FsNode *dir)
+{
+	Bprint(&bout, "%llud\t%N\n", (dir->size + 1023) / 1024, dir);
+}
+
+/* Called by the scanner as dir, depth levels below the scan root,
+ * becomes complete */
+void
+dureport(FsNode *dir, Qid, int depth, long)
+{
+	FsNode *c;
+	int i, n;
+
+	lock(&outlock);
+	n = 0;
+	if(depth < reportdepth) {
+		sort_nodes_by_size(dir);
+		for(i = 0; i < dir->nchildren && dir->children[i]->size >= reportmin; i++) {
+			c = dir->children[i];
+			if(c->isdir && !c->alias) {
+				reportline(c);
+				n++;
+			}
+		}
+	}
+	if(depth == 0) {
+		reportline(dir);
+		n++;
+	}
+	if(n > 0)
+		Bflush(&bout);
+	unlock(&outlock);
+}
+
+/* Choose the format for -e; returns -1 if there is no such format */
+int
+exportformat(char *name)
+{
+	if(strcmp(name, "ndjson") == 0 || strcmp(name, "json") == 0)
+		format = EXPORT_NDJSON;
+	else if(strcmp(name, "csv") == 0)
+		format = EXPORT_CSV;
+	else
+		return -1;
+	return 0;
+}
+
+/* Write s as a JSON string */
+static void
+jsonstr(char *s)
+{
+	uchar c;
+
+	Bputc(&bout, '"');
+	for(; (c = *s) != '\0'; s++) {
+		if(c == '"' || c == '\\')
+			Bprint(&bout, "\\%c", c);
+		else if(c < 0x20)
+			Bprint(&bout, "\\u%04x", c);
+		else
+			Bputc(&bout, c);
+	}
+	Bputc(&bout, '"');
+}
+
+/* Write s as a CSV field, quoted only if it has to be */
+static void
+csvstr(char *s)
+{
+	char *p;
+
+	if(strpbrk(s, ",\"\r\n") == nil) {
+		Bprint(&bout, "%s", s);
+		return;
+	}
+	Bputc(&bout, '"');
+	for(p = s; *p != '\0'; p++) {
+		if(*p == '"')
+			Bputc(&bout, '"');
+		Bputc(&bout, *p);
+	}
+	Bputc(&bout, '"');
+}
+
+static void
+exportrec(char *path, u64int size, int isdir, Qid qid, ulong mtime, int depth, long nentries)
+{
+	lock(&outlock);
+	if(format == EXPORT_CSV) {
+		csvstr(path);
+		Bprint(&bout, ",%llud,%d,%llud,%lud,%lud,%d,%ld\n",
+			size, isdir, qid.path, qid.vers, mtime, depth, nentries);
+	} else {
+		Bprint(&bout, "{\"path\":");
+		jsonstr(path);
+		Bprint(&bout, ",\"size\":%llud,\"isdir\":%s,\"qidpath\":%llud,\"qidvers\":%lud,"
+			"\"mtime\":%lud,\"depth\":%d,\"entries\":%ld}\n",
+			size, isdir ? "true" : "false", qid.path, qid.vers, mtime, depth, nentries);
+	}
+	unlock(&outlock);
+}
+
+/* Called by the scanner as dir becomes complete */
+void
+exportdir(FsNode *dir, Qid qid, int depth, long nentries)
+{
+	char *path;
+
+	path = smprint("%N", dir);
+	if(path == nil)
+		sysfatal("smprint failed: %r");
+	exportrec(path, dir->size, 1, qid, dir->mtime, depth, nentries);
+	free(path);
+}
+
+/* Called by the scanner for each file as dir is listed */
+void
+exportfile(FsNode *dir, Dir *d, int depth)
+{
+	char *path;
+	int n;
+
+	/* Don't double the slash after a root such as "/", as %N */
+	n = strlen(dir->name);
+	if(dir->parent == nil && n > 0 && dir->name[n-1] == '/')
+		path = smprint("%N%s", dir, d->name);
+	else
+		path = smprint("%N/%s", dir, d->name);
+	if(path == nil)
+		sysfatal("smprint failed: %r");
+	exportrec(path, d->length, 0, d->qid, d->mtime, depth, 0);
+	free(path);
+}
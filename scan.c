@@ -0,0 +1,1198 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include "dufus.h"
+
+/* Scanner tuning */
+enum {
+	DEQUE_INIT = 64,       /* Initial capacity of a worker's deque (power of two) */
+	IDLE_WAIT = 10,        /* Milliseconds an idle worker sleeps before looking again */
+	SCAN_STACK = 32*1024,  /* Stack size for each scanner proc */
+	NVISIT = 64,           /* Shards of the visited directory set (power of two) */
+	VISIT_INIT = 64,       /* Initial slots per shard (power of two) */
+	FOLD_MIN = 4096,       /* Smallest file folded once half the budget is used */
+	FOLD_STEPS = 24        /* Doublings of that before the budget is all used */
+};
+
+/* Hooks for reports written as the scan goes. If set, dirdone is
+ * called by the scanner proc that completes each directory, and
+ * filedone for each file as its directory is listed. Unless keepfiles
+ * is set, files are only counted and passed to filedone, and no
+ * nodes are made for them. */
+void (*dirdone)(FsNode *dir, Qid qid, int depth, long nentries);
+void (*filedone)(FsNode *dir, Dir *d, int depth);
+int keepfiles = 1;
+
+/* Memory the nodes of a scan may take, 0 for no limit. Files below a
+ * size that rises as the budget is used, and past the budget whole
+ * subdirectories, are folded into one summary node per directory.
+ * Directory sizes stay exact: what is folded is still counted. */
+vlong membudget;
+
+/* Directories this many levels below the scan root, if not 0, are
+ * pruned: read for their size alone, like folded ones, and left
+ * without children until someone asks for them. */
+int scandepth;
+
+/* Where scans read directories from; nil for the name space */
+Source *scansource;
+
+typedef struct Job Job;
+typedef struct Deque Deque;
+typedef struct Visit Visit;
+typedef struct Alias Alias;
+
+/* A directory that is waiting to be, or is being, scanned */
+struct Job {
+	Lock;                  /* Protects node->size while children roll up into it */
+	FsNode *node;
+	char *path;
+	Job *up;               /* Job of the parent directory, nil at the scan root */
+	FsNode *old;           /* The directory in the tree being refreshed, or nil */
+	int depth;             /* Levels below the scan root */
+	Qid qid;
+	long nentries;         /* Entries listed, for dirdone */
+	long pending;          /* Unfinished subdirectories, plus one for our own listing */
+	FsNode *fold;          /* Summary node that also gets our size, or nil */
+	FsNode scratch;        /* The node of a folded directory, not in the tree */
+	FsNode *kept;          /* Nearest directory that is in the tree */
+	int prune;             /* Node is below the depth limit */
+	vlong nbelow;          /* Entries below us, for a pruned node */
+};
+
+/* Per-worker double-ended queue: the owner works LIFO at the tail,
+ * thieves take the oldest (usually largest) directories from the head */
+struct Deque {
+	Lock;
+	Job **job;
+	int cap;
+	uint head;             /* Next job to be stolen */
+	uint tail;             /* Next free slot */
+};
+
+/* A directory seen by the scan, identified by its file server and
+ * qid.path. Binds and unions show the same tree at several paths;
+ * only the first path a worker reaches it by is read. */
+struct Visit {
+	uvlong path;
+	uint dev;
+	ushort type;
+	FsNode *node;          /* Where it was first seen; nil for a free slot */
+};
+
+/* A shard of the visited set */
+struct Visited {
+	Lock;
+	Visit *tab;
+	ulong ntab;
+	ulong n;
+};
+
+/* A directory that was not read because it was seen elsewhere */
+struct Alias {
+	FsNode *node;
+	FsNode *target;
+};
+
+struct Worker {
+	Scan *s;
+	int id;
+	Deque dq;
+	Arena *arena;          /* Where this worker's nodes are allocated */
+	ulong seed;            /* Victim selection for stealing */
+	long ndirs;            /* Directories listed by this worker */
+	long nentries;         /* Directory entries seen by this worker */
+	long nsame;            /* Unchanged directories carried over from the old tree */
+	long nfolded;          /* Entries folded into summary nodes */
+	FsNode **kids;         /* Children of the directory being listed */
+	int nkids;
+	int maxkids;
+	vlong nbytes;          /* Memory taken by the nodes this worker made */
+	vlong ns[NSCANPHASE];  /* Time spent opening, reading and making nodes */
+	long nphase[NSCANPHASE];
+	Alias *aliases;
+	int naliases;
+	int maxaliases;
+	Top files;             /* Largest files this worker has seen */
+	Top dirs;              /* Largest directories it has finished */
+};
+
+/* The local name space, through the system calls */
+static void*
+localopen(Source*, char *path)
+{
+	int *fd;
+
+	fd = malloc(sizeof(int));
+	if(fd == nil)
+		sysfatal("malloc failed: %r");
+	*fd = open(path, OREAD);
+	if(*fd < 0) {
+		free(fd);
+		return nil;
+	}
+	return fd;
+}
+
+static long
+localdirread(void *dir, Dir **d)
+{
+	return dirread(*(int*)dir, d);
+}
+
+static void
+localclose(void *dir)
+{
+	close(*(int*)dir);
+	free(dir);
+}
+
+static Dir*
+localstat(Source*, char *path)
+{
+	return dirstat(path);
+}
+
+static Source localsource = {
+	"local",
+	localopen,
+	localdirread,
+	localclose,
+	localstat,
+};
+
+/* Create a new filesystem node in arena a */
+FsNode*
+create_fsnode(Arena *a, char *name, u64int size, int isdir, FsNode *parent)
+{
+	FsNode *node = arenanode(a);
+
+	node->name = intern(name);
+	node->size = size;
+	node->isdir = isdir != 0;
+	node->parent = parent;
+	node->children = nil;
+	node->nchildren = 0;
+	node->maxchildren = 0;
+
+	return node;
+}
+
+/* Print the path of a node and its ancestors */
+static int
+pathfmt(Fmt *f, FsNode *node)
+{
+	char *p;
+
+	if(node->parent == nil)
+		return fmtstrcpy(f, node->name);
+
+	if(pathfmt(f, node->parent) < 0)
+		return -1;
+
+	/* Don't double the slash after a root such as "/" */
+	p = node->parent->name;
+	if(node->parent->parent == nil && p[0] != '\0' && p[strlen(p)-1] == '/')
+		return fmtstrcpy(f, node->name);
+
+	return fmtprint(f, "/%s", node->name);
+}
+
+/* %N: the full path of an FsNode, rebuilt from its parent chain */
+int
+nodefmt(Fmt *f)
+{
+	FsNode *node;
+
+	node = va_arg(f->args, FsNode*);
+	if(node == nil)
+		return fmtstrcpy(f, "<nil>");
+
+	return pathfmt(f, node);
+}
+
+/* Add a child to a node. The scanner sizes children arrays exactly
+ * beforehand; anything else grows them in the arena. */
+void
+add_child(Arena *a, FsNode *parent, FsNode *child)
+{
+	if(parent == nil || child == nil)
+		return;
+
+	if(parent->nchildren >= parent->maxchildren)
+		arenachildren(a, parent, parent->maxchildren == 0 ? 16 : parent->maxchildren * 2);
+
+	parent->children[parent->nchildren++] = child;
+}
+
+/* Allocate the scan job for a directory node */
+static Job*
+newjob(FsNode *node, char *path, Job *up, FsNode *old)
+{
+	Job *j;
+
+	j = mallocz(sizeof(Job), 1);
+	if(j == nil)
+		sysfatal("malloc failed: %r");
+
+	/* A folded directory is scanned for its size alone, into a
+	 * node of the job's own */
+	if(node == nil) {
+		node = &j->scratch;
+		node->isdir = 1;
+		node->parent = up->node;
+		j->kept = up->kept;
+	} else
+		j->kept = node;
+
+	j->node = node;
+	j->path = path;
+	j->up = up;
+	j->old = old;
+	j->depth = up != nil ? up->depth + 1 : 0;
+	j->pending = 1;  /* Our own listing */
+
+	/* The directory's size is rebuilt from its children */
+	node->size = 0;
+
+	return j;
+}
+
+/* Queue a job on the worker's own deque */
+static void
+pushjob(Worker *w, Job *j)
+{
+	Deque *q = &w->dq;
+	Job **nj;
+	uint i, n;
+
+	lock(q);
+	n = q->tail - q->head;
+	if(n == q->cap) {
+		/* Grow the ring, unwrapping it into the new array */
+		nj = malloc(2 * q->cap * sizeof(Job*));
+		if(nj == nil)
+			sysfatal("malloc failed: %r");
+		for(i = 0; i < n; i++)
+			nj[i] = q->job[(q->head + i) & (q->cap - 1)];
+		free(q->job);
+		q->job = nj;
+		q->cap *= 2;
+		q->head = 0;
+		q->tail = n;
+	}
+	q->job[q->tail++ & (q->cap - 1)] = j;
+	unlock(q);
+
+	/* Let an idle worker know there is something to steal */
+	if(w->s->nidle > 0)
+		semrelease(&w->s->wake, 1);
+}
+
+/* Take the most recently queued job from the worker's own deque */
+static Job*
+popjob(Worker *w)
+{
+	Deque *q = &w->dq;
+	Job *j = nil;
+
+	lock(q);
+	if(q->tail != q->head)
+		j = q->job[--q->tail & (q->cap - 1)];
+	unlock(q);
+
+	return j;
+}
+
+/* Take the oldest job from another worker's deque */
+static Job*
+stealjob(Worker *w)
+{
+	Scan *s = w->s;
+	Deque *q;
+	Job *j;
+	int i, start;
+
+	if(s->nworkers < 2)
+		return nil;
+
+	w->seed = w->seed * 1103515245 + 12345;
+	start = (w->seed >> 16) % s->nworkers;
+	for(i = 0; i < s->nworkers; i++) {
+		q = &s->workers[(start + i) % s->nworkers].dq;
+		if(q == &w->dq || q->tail == q->head)
+			continue;
+
+		j = nil;
+		lock(q);
+		if(q->tail != q->head)
+			j = q->job[q->head++ & (q->cap - 1)];
+		unlock(q);
+		if(j != nil)
+			return j;
+	}
+
+	return nil;
+}
+
+/* Mark one unit of a job's work as done, rolling finished directories
+ * up into their parents. Children may finish in any order: a directory's
+ * size is only final, and only added to its parent, once its own listing
+ * and every subdirectory below it are complete. */
+static void
+finishjob(Worker *w, Job *j)
+{
+	Scan *s;
+	Job *up;
+
+	s = w->s;
+	while(j != nil && adec(&j->pending) == 0) {
+		if(dirdone != nil)
+			dirdone(j->node, j->qid, j->depth, j->nentries);
+		j->nbelow += j->nentries;
+		if(j->prune) {
+			j->node->maxchildren = j->nbelow < 0x7FFFFFFF ? j->nbelow : 0x7FFFFFFF;
+			coherence();
+			j->node->pruned = 1;
+		}
+		up = j->up;
+		if(up != nil) {
+			if(j->node != &j->scratch)
+				topadd(&w->dirs, j->node);
+			else if(topwants(&w->dirs, j->node->size)) {
+				/* The heap takes the path over */
+				topaddpath(&w->dirs, j->node->size, j->path);
+				j->path = nil;
+			}
+			lock(up);
+			up->node->size += j->node->size;
+			if(j->fold != nil)
+				j->fold->size += j->node->size;
+			up->nbelow += j->nbelow;
+			unlock(up);
+		} else {
+			/* The scan root is complete; release every worker */
+			s->done = 1;
+			semrelease(&s->wake, s->nworkers);
+		}
+
+		if(j->node == &j->scratch)
+			free(j->scratch.name);
+		free(j->path);
+		free(j);
+		j = up;
+	}
+}
+
+/* Charge the time since t to phase; returns the time now */
+static vlong
+lap(Worker *w, int phase, vlong t)
+{
+	vlong now;
+
+	now = nsec();
+	w->ns[phase] += now - t;
+	w->nphase[phase]++;
+	return now;
+}
+
+static int
+isdotdot(char *name)
+{
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+/* The path of name in the directory at path dir, without doubling the
+ * slash after a root such as "/", as %N */
+static char*
+childpath(char *dir, char *name)
+{
+	char *path;
+	int n;
+
+	n = strlen(dir);
+	if(n > 0 && dir[n-1] == '/')
+		path = smprint("%s%s", dir, name);
+	else
+		path = smprint("%s/%s", dir, name);
+	if(path == nil)
+		sysfatal("smprint failed: %r");
+	return path;
+}
+
+/* Offer a file that has no node to the worker's largest files */
+static void
+topfile(Worker *w, Job *j, Dir *d)
+{
+	if(keepfiles && topwants(&w->files, d->length))
+		topaddpath(&w->files, d->length, childpath(j->path, d->name));
+}
+
+/* Make a node in the worker's arena, counting what it costs against
+ * the memory budget: the node, its place in its parent's children
+ * and, at worst, a copy of its name in the pool */
+static FsNode*
+newnode(Worker *w, char *name, u64int size, int isdir, FsNode *parent)
+{
+	w->nbytes += sizeof(FsNode) + sizeof(FsNode*) + strlen(name) + 1;
+	return create_fsnode(w->arena, name, size, isdir, parent);
+}
+
+/* Files smaller than this are folded rather than given nodes; 0 while
+ * less than half the budget is used, then doubling from FOLD_MIN as
+ * the rest of it goes. Once it is gone the doubling stops and *dirs is
+ * set: subdirectories are folded too, but files bigger than that still
+ * get nodes of their own. The workers' counts are read without
+ * locking; they only have to be close. */
+static u64int
+foldsize(Scan *s, int *dirs)
+{
+	vlong used, half;
+	int i;
+
+	*dirs = 0;
+	if(membudget <= 0)
+		return 0;
+
+	used = 0;
+	for(i = 0; i < s->nworkers; i++)
+		used += s->workers[i].nbytes;
+
+	half = membudget / 2;
+	if(used < half)
+		return 0;
+	if(used >= membudget) {
+		*dirs = 1;
+		return (u64int)FOLD_MIN << FOLD_STEPS;
+	}
+	return (u64int)FOLD_MIN << (FOLD_STEPS * (used - half) / (membudget - half));
+}
+
+static ulong
+visithash(uvlong path, uint dev, ushort type)
+{
+	uvlong h;
+
+	h = path * 0x9E3779B97F4A7C15ULL;
+	h ^= (uvlong)dev << 16 ^ type;
+	return h ^ h >> 32;
+}
+
+static void
+growvisited(Visited *v)
+{
+	Visit *tab, *e;
+	ulong i, j, ntab;
+
+	ntab = v->ntab == 0 ? VISIT_INIT : v->ntab * 2;
+	tab = mallocz(ntab * sizeof(Visit), 1);
+	if(tab == nil)
+		sysfatal("malloc failed: %r");
+
+	for(i = 0; i < v->ntab; i++) {
+		e = &v->tab[i];
+		if(e->node == nil)
+			continue;
+		j = (visithash(e->path, e->dev, e->type) / NVISIT) & (ntab - 1);
+		while(tab[j].node != nil)
+			j = (j + 1) & (ntab - 1);
+		tab[j] = *e;
+	}
+
+	free(v->tab);
+	v->tab = tab;
+	v->ntab = ntab;
+}
+
+/* Note that the directory d has been reached as node. If it had been
+ * reached before, return the node it was reached as. */
+static FsNode*
+visit(Scan *s, Dir *d, FsNode *node)
+{
+	Visited *v;
+	Visit *e;
+	ulong h, i;
+
+	h = visithash(d->qid.path, d->dev, d->type);
+	v = &s->visited[h & (NVISIT - 1)];
+
+	lock(v);
+	if(2 * (v->n + 1) > v->ntab)
+		growvisited(v);
+	for(i = (h / NVISIT) & (v->ntab - 1); v->tab[i].node != nil; i = (i + 1) & (v->ntab - 1)) {
+		e = &v->tab[i];
+		if(e->path == d->qid.path && e->dev == d->dev && e->type == d->type) {
+			unlock(v);
+			return e->node;
+		}
+	}
+	e = &v->tab[i];
+	e->path = d->qid.path;
+	e->dev = d->dev;
+	e->type = d->type;
+	e->node = node;
+	v->n++;
+	unlock(v);
+
+	return nil;
+}
+
+/* Mark node as another path to target, to be left unread */
+static void
+addalias(Worker *w, FsNode *node, FsNode *target)
+{
+	node->alias = 1;
+
+	if(w->naliases == w->maxaliases) {
+		w->maxaliases = w->maxaliases == 0 ? 16 : w->maxaliases * 2;
+		w->aliases = realloc(w->aliases, w->maxaliases * sizeof(Alias));
+		if(w->aliases == nil)
+			sysfatal("realloc failed: %r");
+	}
+	w->aliases[w->naliases].node = node;
+	w->aliases[w->naliases].target = target;
+	w->naliases++;
+}
+
+static int
+namecmp(void *a, void *b)
+{
+	return strcmp((*(FsNode**)a)->name, (*(FsNode**)b)->name);
+}
+
+/* The child of old called name, if any; byname is old's children
+ * sorted by name */
+static FsNode*
+oldchild(FsNode **byname, int n, char *name)
+{
+	int lo, hi, mid, c;
+
+	lo = 0;
+	hi = n;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(name, byname[mid]->name);
+		if(c == 0)
+			return byname[mid];
+		if(c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return nil;
+}
+
+/* Carry over a directory that has not changed since the tree being
+ * refreshed was scanned. Its entries are copied without reading it;
+ * each subdirectory is stat'd, since something below it may have
+ * changed even though this directory did not. */
+static void
+copyjob(Worker *w, Job *j)
+{
+	FsNode *node, *old, *oc, *child, *target;
+	Job *nj;
+	Dir *d;
+	char *path;
+	u64int files = 0;
+	int i, n;
+
+	node = j->node;
+	old = j->old;
+
+	arenachildren(w->arena, node, node->nchildren + old->nchildren);
+	n = node->nchildren;
+	for(i = 0; i < old->nchildren; i++) {
+		oc = old->children[i];
+		child = newnode(w, oc->name, oc->size, oc->isdir, node);
+		child->vers = oc->vers;
+		child->mtime = oc->mtime;
+		child->folded = oc->folded;
+		node->children[n++] = child;
+
+		if(!oc->isdir) {
+			files += oc->size;
+			if(!child->folded)
+				topadd(&w->files, child);
+			continue;
+		}
+
+		path = childpath(j->path, oc->name);
+
+		/* If it can't be stat'd, keep what we had */
+		d = w->s->src->stat(w->s->src, path);
+		if(d == nil)
+			fprint(2, "dirstat failed for %s: %r\n", path);
+		else {
+			child->vers = d->qid.vers;
+			child->mtime = d->mtime;
+			target = visit(w->s, d, child);
+			if(target != nil) {
+				addalias(w, child, target);
+				free(d);
+				free(path);
+				continue;
+			}
+		}
+
+		/* Something we skipped as an alias, or only added up, last
+		 * time has to be read */
+		ainc(&j->pending);
+		nj = newjob(child, path, j, oc->alias || oc->pruned ? nil : oc);
+		if(d != nil)
+			nj->qid = d->qid;
+		pushjob(w, nj);
+		free(d);
+	}
+
+	coherence();
+	node->nchildren = n;
+
+	w->nsame++;
+	w->nentries += old->nchildren;
+	j->nentries = old->nchildren;
+
+	lock(j);
+	node->size += files;
+	unlock(j);
+
+	finishjob(w, j);
+}
+
+/* Add up the entries of a folded directory. No nodes are made: its
+ * files are only counted, and its subdirectories are queued as folded
+ * directories in turn. They are still marked visited, against the
+ * nearest directory that is in the tree, so that loops end. */
+static void
+foldjob(Worker *w, Job *j, Dir *dirents, long ndirents)
+{
+	FsNode *node;
+	Job *nj;
+	char *path;
+	u64int files;
+	long i;
+
+	node = j->node;
+	files = 0;
+	for(i = 0; i < ndirents; i++) {
+		if(isdotdot(dirents[i].name))
+			continue;
+
+		j->nentries++;
+		if(!(dirents[i].qid.type & QTDIR)) {
+			files += dirents[i].length;
+			if(filedone != nil)
+				filedone(node, &dirents[i], j->depth + 1);
+			topfile(w, j, &dirents[i]);
+			continue;
+		}
+
+		if(visit(w->s, &dirents[i], j->kept) != nil)
+			continue;
+
+		path = childpath(j->path, dirents[i].name);
+
+		ainc(&j->pending);
+		nj = newjob(nil, path, j, nil);
+		nj->qid = dirents[i].qid;
+		nj->scratch.name = strdup(dirents[i].name);
+		if(nj->scratch.name == nil)
+			sysfatal("strdup failed: %r");
+		nj->scratch.vers = dirents[i].qid.vers;
+		nj->scratch.mtime = dirents[i].mtime;
+		pushjob(w, nj);
+	}
+
+	lock(j);
+	node->size += files;
+	unlock(j);
+}
+
+/* Hold child in the worker's list of the children being listed */
+static void
+addkid(Worker *w, FsNode *child)
+{
+	if(w->nkids == w->maxkids) {
+		w->maxkids = w->maxkids == 0 ? 256 : w->maxkids * 2;
+		w->kids = realloc(w->kids, w->maxkids * sizeof(FsNode*));
+		if(w->kids == nil)
+			sysfatal("realloc failed: %r");
+	}
+	w->kids[w->nkids++] = child;
+}
+
+/* List one directory, queueing its subdirectories for any worker to
+ * take. Entries are read a batch at a time and made into nodes as they
+ * come, so only one batch of Dirs is held however big the directory. */
+static void
+scanjob(Worker *w, Job *j)
+{
+	Source *src;
+	Dir *dirents;
+	long ndirents, nread, i;
+	u64int files = 0, fold, folded;
+	int folddirs;
+	FsNode *node, *child, *summary, **byname;
+	void *dir;
+	vlong t;
+
+	node = j->node;
+
+	/* A cancelled scan just drains its queued jobs */
+	if(w->s->cancel) {
+		finishjob(w, j);
+		return;
+	}
+
+	/* When refreshing, a directory whose version and modification
+	 * time are as they were still has the same entries */
+	if(j->old != nil && j->old->vers == node->vers && j->old->mtime == node->mtime) {
+		copyjob(w, j);
+		return;
+	}
+
+	src = w->s->src;
+	t = nsec();
+	dir = src->open(src, j->path);
+	t = lap(w, PHASE_OPEN, t);
+	if(dir == nil) {
+		if(node == w->s->root)
+			rerrstr(w->s->err, sizeof(w->s->err));
+		fprint(2, "open failed for %s: %r\n", j->path);
+		finishjob(w, j);
+		return;
+	}
+
+	/* A folded directory only adds up its entries, as does one below
+	 * the depth limit, unless it was read before */
+	j->prune = scandepth > 0 && j->depth >= scandepth && node != &j->scratch && j->old == nil;
+	if(node == &j->scratch || j->prune) {
+		nread = 0;
+		for(;;) {
+			ndirents = src->dirread(dir, &dirents);
+			t = lap(w, PHASE_DIRREAD, t);
+			if(ndirents <= 0)
+				break;
+			foldjob(w, j, dirents, ndirents);
+			free(dirents);
+			nread += ndirents;
+			t = lap(w, PHASE_NODES, t);
+		}
+		goto done;
+	}
+
+	/* Subdirectories that were here before are refreshed in turn */
+	byname = nil;
+	if(j->old != nil && j->old->nchildren > 0) {
+		byname = malloc(j->old->nchildren * sizeof(FsNode*));
+		if(byname == nil)
+			sysfatal("malloc failed: %r");
+		memmove(byname, j->old->children, j->old->nchildren * sizeof(FsNode*));
+		qsort(byname, j->old->nchildren, sizeof(FsNode*), namecmp);
+	}
+
+	/* The UI may be looking at this directory: the new children are
+	 * collected in w->kids and only made visible once all are read.
+	 * Everything folded shares one summary node, which folded
+	 * subdirectories add their size to as they finish. */
+	w->nkids = 0;
+	summary = nil;
+	folded = 0;
+	nread = 0;
+	for(;;) {
+		ndirents = src->dirread(dir, &dirents);
+		t = lap(w, PHASE_DIRREAD, t);
+		if(ndirents <= 0)
+			break;
+		nread += ndirents;
+		fold = foldsize(w->s, &folddirs);
+		for(i = 0; i < ndirents; i++) {
+			/* Skip "." and ".." */
+			if(isdotdot(dirents[i].name))
+				continue;
+
+			int isdir = (dirents[i].qid.type & QTDIR);
+			u64int size = dirents[i].length;
+
+			j->nentries++;
+			if(!isdir) {
+				files += size;
+				if(filedone != nil)
+					filedone(node, &dirents[i], j->depth + 1);
+				if(!keepfiles)
+					continue;
+			}
+
+			child = nil;
+			if(isdir ? folddirs : size < fold) {
+				if(summary == nil) {
+					summary = newnode(w, "(folded)", 0, 0, node);
+					summary->folded = 1;
+					addkid(w, summary);
+				}
+				summary->vers++;
+				w->nfolded++;
+				if(!isdir) {
+					folded += size;
+					topfile(w, j, &dirents[i]);
+					continue;
+				}
+			} else {
+				child = newnode(w, dirents[i].name, size, isdir, node);
+				child->vers = dirents[i].qid.vers;
+				child->mtime = dirents[i].mtime;
+				addkid(w, child);
+			}
+
+			if(isdir) {
+				/* Already reached by another path */
+				FsNode *target = visit(w->s, &dirents[i], child != nil ? child : node);
+				if(target != nil) {
+					if(child != nil)
+						addalias(w, child, target);
+					continue;
+				}
+
+				char *path = childpath(j->path, dirents[i].name);
+
+				FsNode *oc = nil;
+				if(byname != nil && child != nil) {
+					oc = oldchild(byname, j->old->nchildren, dirents[i].name);
+					if(oc != nil && (!oc->isdir || oc->alias || oc->pruned))
+						oc = nil;
+				}
+
+				/* The subdirectory's size arrives when its job finishes */
+				ainc(&j->pending);
+				Job *nj = newjob(child, path, j, oc);
+				nj->qid = dirents[i].qid;
+				if(child == nil) {
+					nj->scratch.name = strdup(dirents[i].name);
+					if(nj->scratch.name == nil)
+						sysfatal("strdup failed: %r");
+					nj->scratch.vers = dirents[i].qid.vers;
+					nj->scratch.mtime = dirents[i].mtime;
+					nj->fold = summary;
+				}
+				pushjob(w, nj);
+			} else
+				topadd(&w->files, child);
+		}
+		free(dirents);
+		t = lap(w, PHASE_NODES, t);
+	}
+	free(byname);
+
+	/* One exactly sized children array, published once */
+	arenachildren(w->arena, node, node->nchildren + w->nkids);
+	memmove(node->children + node->nchildren, w->kids, w->nkids * sizeof(FsNode*));
+	coherence();
+	node->nchildren += w->nkids;
+
+	lock(j);
+	node->size += files;
+	if(summary != nil)
+		summary->size += folded;
+	unlock(j);
+
+done:
+	/* Whatever was read before an error is kept */
+	if(ndirents < 0)
+		fprint(2, "dirread failed for %s: %r\n", j->path);
+	src->close(dir);
+
+	w->ndirs++;
+	w->nentries += nread;
+
+	finishjob(w, j);
+}
+
+/* Scanner proc: run local work, steal when out, sleep when nobody has any */
+static void
+scanproc(void *arg)
+{
+	Worker *w = arg;
+	Scan *s = w->s;
+	Job *j;
+
+	threadsetname("scan %d", w->id);
+
+	while(!s->done) {
+		j = popjob(w);
+		if(j == nil)
+			j = stealjob(w);
+		if(j == nil) {
+			ainc(&s->nidle);
+			tsemacquire(&s->wake, IDLE_WAIT);
+			adec(&s->nidle);
+			continue;
+		}
+		scanjob(w, j);
+	}
+
+	if(adec(&s->running) == 0)
+		semrelease(&s->finished, 1);
+}
+
+/* Watcher proc: tick while the scan runs, then report that it is over */
+static void
+watchproc(void *arg)
+{
+	Scan *s = arg;
+	ScanMsg m;
+
+	threadsetname("scanwatch");
+
+	m.scan = s;
+	m.done = 0;
+	while(!waitscan(s, SCAN_TICK))
+		nbsend(s->c, &m);  /* Skip ticks the UI is too busy for */
+
+	m.done = 1;
+	send(s->c, &m);
+}
+
+/* Start scanning path into parent with a pool of nproc scanner procs,
+ * allocating the new nodes in sub-arenas of tree. If old is not nil it
+ * is an earlier scan of path: directories that have not changed since
+ * are copied from it instead of being read again, and it must not be
+ * modified until the scan is over. If c is not nil, a ScanMsg is sent
+ * on it every SCAN_TICK while the scan runs and once more, with done
+ * set, when it is over. */
+Scan*
+startscan(Arena *tree, char *path, FsNode *parent, FsNode *old, int nproc, Channel *c)
+{
+	Scan *s;
+	Worker *w;
+	Job *j;
+	Dir *d;
+	int i;
+
+	if(nproc < 1)
+		nproc = 1;
+	if(nproc > MAX_SCANPROCS)
+		nproc = MAX_SCANPROCS;
+
+	s = mallocz(sizeof(Scan), 1);
+	if(s == nil)
+		sysfatal("malloc failed: %r");
+	s->workers = mallocz(nproc * sizeof(Worker), 1);
+	if(s->workers == nil)
+		sysfatal("malloc failed: %r");
+	s->nworkers = nproc;
+	s->running = nproc;
+	s->tree = tree;
+	s->root = parent;
+	s->old = old;
+	s->c = c;
+	s->src = scansource != nil ? scansource : &localsource;
+	s->start = nsec();
+	s->visited = mallocz(NVISIT * sizeof(Visited), 1);
+	if(s->visited == nil)
+		sysfatal("malloc failed: %r");
+
+	for(i = 0; i < nproc; i++) {
+		w = &s->workers[i];
+		w->s = s;
+		w->id = i;
+		w->seed = i + 1;
+		w->arena = subarena(tree);
+		w->dq.cap = DEQUE_INIT;
+		w->dq.job = malloc(DEQUE_INIT * sizeof(Job*));
+		if(w->dq.job == nil)
+			sysfatal("malloc failed: %r");
+		topinit(&w->files, ntop);
+		topinit(&w->dirs, ntop);
+	}
+
+	/* Entries get their version from the listing they appear in;
+	 * the root has to be asked */
+	d = s->src->stat(s->src, path);
+	if(d != nil) {
+		parent->vers = d->qid.vers;
+		parent->mtime = d->mtime;
+		visit(s, d, parent);
+	}
+
+	/* Seed the first worker with the root of the scan */
+	path = strdup(path);
+	if(path == nil)
+		sysfatal("strdup failed: %r");
+	j = newjob(parent, path, nil, old);
+	if(d != nil)
+		j->qid = d->qid;
+	free(d);
+	pushjob(&s->workers[0], j);
+
+	for(i = 0; i < nproc; i++)
+		if(proccreate(scanproc, &s->workers[i], SCAN_STACK) < 0)
+			sysfatal("proccreate: %r");
+
+	if(c != nil && proccreate(watchproc, s, SCAN_STACK) < 0)
+		sysfatal("proccreate: %r");
+
+	return s;
+}
+
+/* Wait up to ms milliseconds (forever if ms < 0) for the scan to finish;
+ * returns 1 once every scanner proc has exited */
+int
+waitscan(Scan *s, int ms)
+{
+	if(s->finished_seen)
+		return 1;
+
+	if(ms < 0)
+		semacquire(&s->finished, 1);
+	else if(tsemacquire(&s->finished, ms) <= 0)
+		return 0;
+
+	s->finished_seen = 1;
+	return 1;
+}
+
+/* Report how far a scan has come: directories read, entries seen,
+ * and directories carried over unchanged from the old tree */
+void
+scanprogress(Scan *s, long *ndirs, long *nentries, long *nsame)
+{
+	int i;
+
+	*ndirs = 0;
+	*nentries = 0;
+	*nsame = 0;
+	for(i = 0; i < s->nworkers; i++) {
+		*ndirs += s->workers[i].ndirs;
+		*nentries += s->workers[i].nentries;
+		*nsame += s->workers[i].nsame;
+	}
+}
+
+/* Report the entries a scan folded into summary nodes to keep within
+ * the memory budget, and the memory its nodes take */
+void
+scanfolded(Scan *s, long *nfolded, vlong *nbytes)
+{
+	int i;
+
+	*nfolded = 0;
+	*nbytes = 0;
+	for(i = 0; i < s->nworkers; i++) {
+		*nfolded += s->workers[i].nfolded;
+		*nbytes += s->workers[i].nbytes;
+	}
+}
+
+/* Add the time a scan has spent in each of its phases, and how often
+ * it entered them, to ns and n */
+void
+scanphases(Scan *s, vlong *ns, long *n)
+{
+	int i, p;
+
+	for(i = 0; i < s->nworkers; i++) {
+		for(p = 0; p < NSCANPHASE; p++) {
+			ns[p] += s->workers[i].ns[p];
+			n[p] += s->workers[i].nphase[p];
+		}
+	}
+}
+
+static long
+countdirs(FsNode *node)
+{
+	long n;
+	int i;
+
+	n = 1;
+	for(i = 0; i < node->nchildren; i++)
+		if(node->children[i]->isdir && !node->children[i]->alias)
+			n += countdirs(node->children[i]);
+
+	return n;
+}
+
+/* Report the directories a finished scan did not read because they
+ * had been reached by another path, with the directories and bytes
+ * below them that would have been read and counted again */
+void
+scanaliases(Scan *s, long *naliases, long *ndirs, vlong *nbytes)
+{
+	Worker *w;
+	Alias *a;
+
+	*naliases = 0;
+	*ndirs = 0;
+	*nbytes = 0;
+	for(w = s->workers; w < s->workers + s->nworkers; w++) {
+		for(a = w->aliases; a < w->aliases + w->naliases; a++) {
+			*ndirs += countdirs(a->target);
+			*nbytes += a->target->size;
+		}
+		*naliases += w->naliases;
+	}
+}
+
+/* Collect the ntop largest files and directories of a finished scan
+ * into files and dirs, largest first. The scan root is not among the
+ * directories. Free them with topfree(). */
+void
+scantop(Scan *s, Top *files, Top *dirs)
+{
+	Worker *w;
+
+	topinit(files, ntop);
+	topinit(dirs, ntop);
+	for(w = s->workers; w < s->workers + s->nworkers; w++) {
+		topmerge(files, &w->files);
+		topmerge(dirs, &w->dirs);
+	}
+	topsort(files);
+	topsort(dirs);
+}
+
+/* Ask a scan to stop; directories not yet listed are left empty */
+void
+cancelscan(Scan *s)
+{
+	s->cancel = 1;
+}
+
+/* Wait for a scan to finish and release it. A scan with a channel
+ * must only be ended after its done message has been received. */
+void
+endscan(Scan *s)
+{
+	long ndirs, nentries, nsame;
+	int i;
+
+	waitscan(s, -1);
+
+	/* What it did goes into the stats */
+	scanphases(s, stats.ns, stats.n);
+	scanprogress(s, &ndirs, &nentries, &nsame);
+	stats.ndirs += ndirs;
+	stats.nentries += nentries;
+	stats.scanns += nsec() - s->start;
+
+	for(i = 0; i < s->nworkers; i++) {
+		free(s->workers[i].dq.job);
+		free(s->workers[i].aliases);
+		free(s->workers[i].kids);
+		topfree(&s->workers[i].files);
+		topfree(&s->workers[i].dirs);
+	}
+	for(i = 0; i < NVISIT; i++)
+		free(s->visited[i].tab);
+	free(s->visited);
+	free(s->workers);
+	free(s);
+}
+
+/* Scan a directory tree into parent, blocking until it is complete */
+void
+scan_directory(Arena *tree, char *path, FsNode *parent)
+{
+	endscan(startscan(tree, path, parent, nil, nscanprocs, nil));
+}
@@ -0,0 +1,327 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include <bio.h>
+#include <fcall.h>
+#include "dufus.h"
+
+/*
+ * Snapshots of a scanned tree on disk, so a tree can be scanned once
+ * and browsed later. The file holds no pointers:
+ *
+ *	header	magic[8] nnodes[4] namebytes[4]
+ *	nodes	nnodes records of
+ *		size[8] name[4] first[4] nchildren[4] flags[4] vers[4] mtime[4]
+ *	names	namebytes bytes of NUL-terminated names
+ *
+ * Integers are little-endian. Node 0 is the root and its name is the
+ * scanned path. The children of a node are the nchildren records
+ * starting at index first, which is always past the node's own index,
+ * and name is a byte offset into the names. A directory's vers and
+ * mtime are its qid.vers and mtime when it was scanned, so a tree read
+ * back can be refreshed. A summary of folded entries keeps their number
+ * in vers, and a directory pruned by the depth limit the number of
+ * entries below it in first. Nodes are written breadth first, so each
+ * directory's children are contiguous.
+ *
+ * Reading a snapshot loads the file into the tree's arena in one
+ * read and checks it, but makes FsNodes only for the root. The
+ * children of a directory are made by loadchildren() when a view
+ * first needs them, with names pointing straight into the loaded
+ * string table.
+ */
+
+enum {
+	HDRSIZE = 16,
+	RECSIZE = 32,
+	SNAPFLAG_DIR = 1,
+	SNAPFLAG_ALIAS = 2,
+	SNAPFLAG_FOLDED = 4,
+	SNAPFLAG_PRUNED = 8
+};
+
+static char snapmagic[8] = "DUFSNAP2";
+
+/* Names already in the string table, keyed by pooled pointer */
+typedef struct Strtab Strtab;
+struct Strtab {
+	char **key;
+	ulong *off;
+	ulong ntab;
+	ulong nused;
+	char *buf;
+	ulong nbuf;
+	ulong maxbuf;
+};
+
+static ulong
+strhash(char *s)
+{
+	uintptr p;
+
+	p = (uintptr)s;
+	return (p >> 3) ^ (p >> 17);
+}
+
+static void
+growstrtab(Strtab *t)
+{
+	char **key;
+	ulong *off, i, j, ntab;
+
+	ntab = t->ntab == 0 ? 1024 : t->ntab * 2;
+	key = mallocz(ntab * sizeof(char*), 1);
+	off = malloc(ntab * sizeof(ulong));
+	if(key == nil || off == nil)
+		sysfatal("malloc failed: %r");
+
+	for(i = 0; i < t->ntab; i++) {
+		if(t->key[i] == nil)
+			continue;
+		for(j = strhash(t->key[i]) & (ntab - 1); key[j] != nil; j = (j + 1) & (ntab - 1))
+			;
+		key[j] = t->key[i];
+		off[j] = t->off[i];
+	}
+
+	free(t->key);
+	free(t->off);
+	t->key = key;
+	t->off = off;
+	t->ntab = ntab;
+}
+
+/* Offset of s in the string table, adding it the first time. Names
+ * are pooled, so the same name is always the same pointer. */
+static ulong
+addname(Strtab *t, char *s)
+{
+	ulong i, len;
+
+	if(2 * (t->nused + 1) > t->ntab)
+		growstrtab(t);
+
+	for(i = strhash(s) & (t->ntab - 1); t->key[i] != nil; i = (i + 1) & (t->ntab - 1))
+		if(t->key[i] == s)
+			return t->off[i];
+
+	len = strlen(s) + 1;
+	if(t->nbuf + len > t->maxbuf) {
+		t->maxbuf = t->maxbuf == 0 ? 64*1024 : t->maxbuf * 2;
+		if(t->maxbuf < t->nbuf + len)
+			t->maxbuf = t->nbuf + len;
+		t->buf = realloc(t->buf, t->maxbuf);
+		if(t->buf == nil)
+			sysfatal("realloc failed: %r");
+	}
+	memmove(t->buf + t->nbuf, s, len);
+
+	t->key[i] = s;
+	t->off[i] = t->nbuf;
+	t->nused++;
+	t->nbuf += len;
+
+	return t->off[i];
+}
+
+/* Write the tree under root to file; returns -1 with the error set */
+int
+writesnap(FsNode *root, char *file)
+{
+	Biobuf *b;
+	Strtab st;
+	FsNode **queue, *node;
+	ulong nqueue, maxqueue, i, next;
+	uchar rec[RECSIZE], hdr[HDRSIZE];
+	int j, err;
+
+	b = Bopen(file, OWRITE);
+	if(b == nil)
+		return -1;
+
+	memset(&st, 0, sizeof(st));
+	maxqueue = 1024;
+	queue = malloc(maxqueue * sizeof(FsNode*));
+	if(queue == nil)
+		sysfatal("malloc failed: %r");
+
+	/* Room for the header, filled in once the counts are known */
+	memset(hdr, 0, sizeof(hdr));
+	err = Bwrite(b, hdr, HDRSIZE) != HDRSIZE;
+
+	/* The queue is the node table: node i's children are numbered as
+	 * they are queued, right after everything queued before them */
+	queue[0] = root;
+	nqueue = 1;
+	next = 1;
+	for(i = 0; i < nqueue && !err; i++) {
+		node = queue[i];
+
+		if(nqueue + node->nchildren > maxqueue) {
+			while(nqueue + node->nchildren > maxqueue)
+				maxqueue *= 2;
+			queue = realloc(queue, maxqueue * sizeof(FsNode*));
+			if(queue == nil)
+				sysfatal("realloc failed: %r");
+		}
+		for(j = 0; j < node->nchildren; j++)
+			queue[nqueue++] = node->children[j];
+
+		PBIT64(rec, node->size);
+		PBIT32(rec+8, addname(&st, node->name));
+		PBIT32(rec+12, node->pruned ? node->maxchildren : next);
+		PBIT32(rec+16, node->nchildren);
+		PBIT32(rec+20, (node->isdir ? SNAPFLAG_DIR : 0) | (node->alias ? SNAPFLAG_ALIAS : 0) |
+			(node->folded ? SNAPFLAG_FOLDED : 0) | (node->pruned ? SNAPFLAG_PRUNED : 0));
+		PBIT32(rec+24, node->vers);
+		PBIT32(rec+28, node->mtime);
+		next += node->nchildren;
+
+		err = Bwrite(b, rec, RECSIZE) != RECSIZE;
+	}
+	free(queue);
+
+	if(!err)
+		err = Bwrite(b, st.buf, st.nbuf) != st.nbuf;
+	if(!err)
+		err = Bflush(b) < 0;
+	if(!err) {
+		memmove(hdr, snapmagic, 8);
+		PBIT32(hdr+8, nqueue);
+		PBIT32(hdr+12, st.nbuf);
+		err = pwrite(Bfildes(b), hdr, HDRSIZE, 0) != HDRSIZE;
+	}
+
+	free(st.key);
+	free(st.off);
+	free(st.buf);
+	Bterm(b);
+
+	return err ? -1 : 0;
+}
+
+/* Make the FsNode for record i */
+static FsNode*
+snapnode(Snap *sn, ulong i, FsNode *parent)
+{
+	FsNode *node;
+	uchar *p;
+
+	p = sn->nodes + i * RECSIZE;
+	node = arenanode(sn->tree);
+	node->name = sn->names + GBIT32(p+8);
+	node->parent = parent;
+	node->size = GBIT64(p);
+	node->isdir = (GBIT32(p+20) & SNAPFLAG_DIR) != 0;
+	node->alias = (GBIT32(p+20) & SNAPFLAG_ALIAS) != 0;
+	node->folded = (GBIT32(p+20) & SNAPFLAG_FOLDED) != 0;
+	if(GBIT32(p+20) & SNAPFLAG_PRUNED) {
+		node->pruned = 1;
+		node->maxchildren = GBIT32(p+12);
+	}
+	node->vers = GBIT32(p+24);
+	node->mtime = GBIT32(p+28);
+
+	/* Children stay on disk until loadchildren() */
+	node->nchildren = GBIT32(p+16);
+	if(node->nchildren > 0) {
+		node->lazy = 1;
+		node->maxchildren = i;
+	}
+
+	return node;
+}
+
+/* Read a snapshot into tree; returns nil with the error set */
+Snap*
+readsnap(Arena *tree, char *file)
+{
+	Snap *sn;
+	Dir *d;
+	uchar *buf, *p;
+	ulong nnodes, namebytes, i, first, n, name;
+	vlong len;
+	int fd;
+
+	fd = open(file, OREAD);
+	if(fd < 0)
+		return nil;
+
+	d = dirfstat(fd);
+	if(d == nil) {
+		close(fd);
+		return nil;
+	}
+	len = d->length;
+	free(d);
+
+	if(len < HDRSIZE + RECSIZE || len != (ulong)len) {
+		close(fd);
+		werrstr("not a snapshot");
+		return nil;
+	}
+
+	/* The file stays loaded as long as the tree */
+	buf = arenaalloc(tree, len);
+	if(readn(fd, buf, len) != len) {
+		close(fd);
+		werrstr("short read");
+		return nil;
+	}
+	close(fd);
+
+	nnodes = GBIT32(buf+8);
+	namebytes = GBIT32(buf+12);
+	if(memcmp(buf, snapmagic, 8) != 0 || nnodes == 0 || namebytes == 0 ||
+	   HDRSIZE + (vlong)nnodes * RECSIZE + namebytes != len || buf[len-1] != '\0') {
+		werrstr("not a snapshot");
+		return nil;
+	}
+
+	/* Check every record now so loading children later cannot fail */
+	for(i = 0; i < nnodes; i++) {
+		p = buf + HDRSIZE + i * RECSIZE;
+		name = GBIT32(p+8);
+		first = GBIT32(p+12);
+		n = GBIT32(p+16);
+		if(name >= namebytes || n > nnodes || (n > 0 && (first <= i || first > nnodes - n))) {
+			werrstr("corrupt snapshot: bad node %lud", i);
+			return nil;
+		}
+	}
+
+	sn = arenaalloc(tree, sizeof(Snap));
+	sn->tree = tree;
+	sn->nodes = buf + HDRSIZE;
+	sn->nnodes = nnodes;
+	sn->names = (char*)buf + HDRSIZE + nnodes * RECSIZE;
+	sn->namebytes = namebytes;
+	sn->root = snapnode(sn, 0, nil);
+
+	return sn;
+}
+
+/* Make the children of a node read from a snapshot, if not done yet */
+void
+loadchildren(Snap *sn, FsNode *node)
+{
+	uchar *p;
+	ulong i, first;
+	int n;
+
+	if(node == nil || !node->lazy)
+		return;
+
+	p = sn->nodes + node->maxchildren * RECSIZE;
+	first = GBIT32(p+12);
+	n = node->nchildren;
+
+	node->lazy = 0;
+	node->nchildren = 0;
+	node->maxchildren = 0;
+	arenachildren(sn->tree, node, n);
+	for(i = 0; i < n; i++)
+		node->children[i] = snapnode(sn, first + i, node);
+	node->nchildren = n;
+}
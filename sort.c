@@ -0,0 +1,247 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include "dufus.h"
+
+/*
+ * Children are ordered largest first, lazily. A directory's
+ * children[0..nsorted) are its nsorted largest children in order;
+ * the rest are in no particular order. Views ask for as many leading
+ * children as they can show with sort_top_children(), so a directory
+ * that is never displayed is never sorted, and a huge one is only
+ * partially ordered.
+ *
+ * Sizes are copied out before sorting: while a scan is running they
+ * keep growing under us, and the radix passes must all see the same
+ * keys. When they have grown, unsort_all bumps sizegen, and each
+ * directory's sorted prefix is dropped the next time it is asked for,
+ * rather than every directory being visited at once.
+ */
+
+enum {
+	INSERTION_MAX = 32     /* Below this, insertion sort beats radix */
+};
+
+ulong sizegen = 1;
+
+typedef struct Key Key;
+
+struct Key {
+	u64int size;
+	FsNode *node;
+};
+
+static void
+insertionsort(Key *a, int n)
+{
+	int i, j;
+	Key t;
+
+	for(i = 1; i < n; i++) {
+		t = a[i];
+		for(j = i; j > 0 && a[j-1].size < t.size; j--)
+			a[j] = a[j-1];
+		a[j] = t;
+	}
+}
+
+/* Stable LSD radix sort on the 64-bit sizes, largest first. Passes
+ * whose byte is the same for every key are skipped, so typical sizes
+ * cost three or four passes. */
+static void
+radixsort(Key *a, int n)
+{
+	Key *tmp, *src, *dst, *t;
+	ulong count[256], pos, c;
+	int shift, i;
+
+	if(n < INSERTION_MAX) {
+		insertionsort(a, n);
+		return;
+	}
+
+	tmp = malloc(n * sizeof(Key));
+	if(tmp == nil)
+		sysfatal("malloc failed: %r");
+
+	src = a;
+	dst = tmp;
+	for(shift = 0; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for(i = 0; i < n; i++)
+			count[(~src[i].size >> shift) & 0xFF]++;
+
+		/* Nothing to do if every key has the same byte here */
+		if(count[(~src[0].size >> shift) & 0xFF] == n)
+			continue;
+
+		pos = 0;
+		for(i = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = pos;
+			pos += c;
+		}
+
+		for(i = 0; i < n; i++)
+			dst[count[(~src[i].size >> shift) & 0xFF]++] = src[i];
+
+		t = src;
+		src = dst;
+		dst = t;
+	}
+
+	if(src != a)
+		memmove(a, src, n * sizeof(Key));
+	free(tmp);
+}
+
+/* Move the k largest of a[0..n) to the front, in no particular order */
+static void
+selecttop(Key *a, int n, int k)
+{
+	int lo, hi, mid, i, j;
+	u64int pivot, x, y, z;
+	Key t;
+
+	lo = 0;
+	hi = n - 1;
+	while(hi > lo) {
+		/* Median of three */
+		mid = lo + (hi - lo) / 2;
+		x = a[lo].size;
+		y = a[mid].size;
+		z = a[hi].size;
+		if((x <= y && y <= z) || (z <= y && y <= x))
+			pivot = y;
+		else if((y <= x && x <= z) || (z <= x && x <= y))
+			pivot = x;
+		else
+			pivot = z;
+
+		i = lo;
+		j = hi;
+		while(i <= j) {
+			while(a[i].size > pivot)
+				i++;
+			while(a[j].size < pivot)
+				j--;
+			if(i <= j) {
+				t = a[i];
+				a[i] = a[j];
+				a[j] = t;
+				i++;
+				j--;
+			}
+		}
+
+		/* a[lo..j] >= pivot >= a[i..hi]; anything between equals it */
+		if(k - 1 <= j)
+			hi = j;
+		else if(k - 1 >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
+/* Copy out the keys of children[from..to) */
+static Key*
+getkeys(FsNode *parent, int from, int to)
+{
+	Key *k;
+	int i;
+
+	k = malloc((to - from) * sizeof(Key));
+	if(k == nil)
+		sysfatal("malloc failed: %r");
+	for(i = from; i < to; i++) {
+		k[i-from].node = parent->children[i];
+		k[i-from].size = parent->children[i]->size;
+	}
+
+	return k;
+}
+
+/* Store the first n keys back as children[from..from+n) */
+static void
+putkeys(FsNode *parent, int from, Key *k, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++)
+		parent->children[from+i] = k[i].node;
+}
+
+/* Drop parent's sorted prefix if sizes have changed since it was
+ * sorted */
+static void
+checksorted(FsNode *parent)
+{
+	if(parent->sortgen != (u32int)sizegen) {
+		parent->nsorted = 0;
+		parent->sortgen = sizegen;
+	}
+}
+
+/* Sort all of a directory's children by size (largest first) */
+void
+sort_nodes_by_size(FsNode *parent)
+{
+	Key *k;
+	int n, done;
+
+	if(parent == nil)
+		return;
+	checksorted(parent);
+	if(parent->nsorted >= parent->nchildren)
+		return;
+
+	/* The sorted prefix is already in place; everything after it is smaller */
+	n = parent->nchildren;
+	done = parent->nsorted;
+	k = getkeys(parent, done, n);
+	radixsort(k, n - done);
+	putkeys(parent, done, k, n - done);
+	free(k);
+	parent->nsorted = n;
+}
+
+/* Make sure the k largest children come first, in order */
+void
+sort_top_children(FsNode *parent, int k)
+{
+	Key *keys;
+	int n, done;
+
+	if(parent == nil)
+		return;
+	checksorted(parent);
+
+	n = parent->nchildren;
+	if(k > n)
+		k = n;
+	done = parent->nsorted;
+	if(k <= done)
+		return;
+
+	/* Selecting only pays off for a small part of the rest */
+	if(k - done > (n - done) / 4) {
+		sort_nodes_by_size(parent);
+		return;
+	}
+
+	keys = getkeys(parent, done, n);
+	selecttop(keys, n - done, k - done);
+	radixsort(keys, k - done);
+	putkeys(parent, done, keys, n - done);
+	free(keys);
+	parent->nsorted = k;
+}
+
+/* Sizes have changed all over: forget the order of every directory */
+void
+unsort_all(void)
+{
+	sizegen++;
+}
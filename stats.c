@@ -0,0 +1,162 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include "dufus.h"
+
+/*
+ * Where the time goes, for the stats overlay and -S.
+ *
+ * The scanner procs time opening directories, reading them and making
+ * nodes of what they read, each proc keeping its own totals (see
+ * scanjob); a scan's are added to stats by endscan. Their times are
+ * summed over the procs, so with several procs they add up to more
+ * than the scan took.
+ *
+ * The main proc times sorting, layout, drawing and flushing. These
+ * nest, as a layout sorts as it goes and a frame lays out the
+ * treemap, so the phases are kept on a stack and each is charged only
+ * for the time it is on top: drawing is drawing alone, without the
+ * layout and sorting it called for.
+ */
+
+enum {
+	MAXNEST = 8
+};
+
+Stats stats;
+
+static int phasestack[MAXNEST];
+static int nphase;
+static vlong phasestart;
+static vlong framestart;
+
+/* Start timing phase, pausing the phase it is nested in */
+void
+phasebegin(int phase)
+{
+	vlong now;
+
+	now = nsec();
+	if(nphase > 0)
+		stats.ns[phasestack[nphase-1]] += now - phasestart;
+	if(nphase == MAXNEST)
+		sysfatal("phases nested too deep");
+	phasestack[nphase++] = phase;
+	stats.n[phase]++;
+	phasestart = now;
+}
+
+/* Stop timing the innermost phase, resuming the one it was nested in */
+void
+phaseend(void)
+{
+	vlong now;
+
+	now = nsec();
+	stats.ns[phasestack[--nphase]] += now - phasestart;
+	phasestart = now;
+}
+
+/* A frame is everything drawn until the next flushimage */
+void
+framebegin(void)
+{
+	phasebegin(PHASE_DRAW);
+	framestart = nsec();
+	stats.drawing = 0;
+}
+
+void
+frameend(void)
+{
+	phasebegin(PHASE_FLUSH);
+	flushimage(display, 1);
+	phaseend();
+	phaseend();
+	stats.frames++;
+	stats.framens = nsec() - framestart;
+	stats.drawn = stats.drawing;
+}
+
+static char*
+fmtns(char *buf, int n, vlong ns)
+{
+	if(ns < 1000)
+		snprint(buf, n, "%lldns", ns);
+	else if(ns < 1000000)
+		snprint(buf, n, "%.1fµs", ns / 1e3);
+	else if(ns < 1000000000)
+		snprint(buf, n, "%.1fms", ns / 1e6);
+	else
+		snprint(buf, n, "%.2fs", ns / 1e9);
+	return buf;
+}
+
+/* Write the stats as lines of text, counting scan if it is still
+ * running and the memory of tree; returns the number of lines */
+int
+statslines(Scan *s, Arena *tree, char (*line)[STATS_LINELEN])
+{
+	static char *name[NPHASE] = {
+		"open", "dirread", "nodes", "sort", "layout", "draw", "flush"
+	};
+	char t[32], each[32];
+	vlong ns[NPHASE], scanns;
+	long n[NPHASE], ndirs, nentries, nsame;
+	TreeStats ts;
+	double secs;
+	int i, nl;
+
+	memmove(ns, stats.ns, sizeof(ns));
+	memmove(n, stats.n, sizeof(n));
+	ndirs = stats.ndirs;
+	nentries = stats.nentries;
+	scanns = stats.scanns;
+	if(s != nil) {
+		scanphases(s, ns, n);
+		scanprogress(s, &ndirs, &nentries, &nsame);
+		ndirs += stats.ndirs;
+		nentries += stats.nentries;
+		scanns += nsec() - s->start;
+	}
+
+	nl = 0;
+	snprint(line[nl++], STATS_LINELEN, "%-8s %10s %10s %10s", "phase", "time", "calls", "each");
+	for(i = 0; i < NPHASE; i++) {
+		if(n[i] > 0)
+			fmtns(each, sizeof(each), ns[i] / n[i]);
+		else
+			strcpy(each, "-");
+		snprint(line[nl++], STATS_LINELEN, "%-8s %10s %10ld %10s",
+			name[i], fmtns(t, sizeof(t), ns[i]), n[i], each);
+	}
+
+	secs = scanns > 0 ? scanns / 1e9 : 1;
+	snprint(line[nl++], STATS_LINELEN, "scan     %ld dirs, %ld entries in %s",
+		ndirs, nentries, fmtns(t, sizeof(t), scanns));
+	snprint(line[nl++], STATS_LINELEN, "         %.0f dirs/s, %.0f nodes/s",
+		ndirs / secs, nentries / secs);
+	if(tree != nil) {
+		arenastats(tree, &ts);
+		snprint(line[nl++], STATS_LINELEN, "tree     %s in %ld nodes",
+			format_size(ts.chunkbytes + ts.namebytes), ts.nodes);
+	}
+	if(stats.frames > 0)
+		snprint(line[nl++], STATS_LINELEN, "frame    %s, %ld nodes drawn, %ld frames",
+			fmtns(t, sizeof(t), stats.framens), stats.drawn, stats.frames);
+
+	return nl;
+}
+
+/* The stats for -S */
+void
+printstats(int fd, Scan *s, Arena *tree)
+{
+	char line[STATS_LINES][STATS_LINELEN];
+	int i, n;
+
+	n = statslines(s, tree, line);
+	for(i = 0; i < n; i++)
+		fprint(fd, "%s\n", line[i]);
+}
@@ -0,0 +1,447 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include "dufus.h"
+
+/*
+ * A scan source that makes trees up, for trying dufus on trees of any
+ * size without building them on disk. What a directory holds follows
+ * from its path alone, so nothing is kept between calls and the same
+ * spec and seed always give the same tree. The shapes are those of
+ * fractal_fs.rc, with a tree of each under "fractal", and two more:
+ *
+ *	sierpinski	directories a, b and c at every level
+ *	mandelbrot	four branches near the top, fewer further down
+ *	koch		four segments at every level
+ *	dragon		a left and a right turn at every level
+ *	wide		one directory of files
+ *	deep		a chain of directories, each holding files
+ *
+ * A tree is made as deep as it has to be to hold about the number of
+ * entries asked for. File sizes shrink going down as in
+ * fractal_fs.rc, plus a little noise from the seed. Wide directories
+ * are read a batch at a time, so even they take no memory here.
+ */
+
+enum {
+	SYNTH_BATCH = 1024,        /* Entries returned by each dirread */
+	SYNTH_MAXDEPTH = 64,
+	SYNTH_MAXDEEP = 100,       /* Levels of a deep tree, at most */
+	SYNTH_NDEFAULT = 100000,
+	NAMELEN = 32
+};
+
+enum {
+	Sierpinski,
+	Mandelbrot,
+	Koch,
+	Dragon,
+	Wide,
+	Deep,
+	Fractal,
+	Nshape
+};
+
+static char *shapename[Nshape] = {
+	"sierpinski", "mandelbrot", "koch", "dragon", "wide", "deep", "fractal"
+};
+
+typedef struct Synth Synth;
+typedef struct Sdir Sdir;
+typedef struct Sopen Sopen;
+
+struct Synth {
+	int shape;
+	vlong n;                   /* Entries asked for */
+	ulong seed;
+	int depth[Nshape];         /* Depth of the bottom level of each shape */
+	vlong nfiles;              /* For wide and deep: files per directory */
+};
+
+/* Where a path leads */
+struct Sdir {
+	int shape;
+	int depth;                 /* The root of a shape is at 1 */
+	u64int size;               /* Size budget, as fractal_fs.rc's */
+	int angle;                 /* Dragon's heading */
+	uvlong id;                 /* Hash of the path, the qid.path */
+};
+
+/* An open directory */
+struct Sopen {
+	Synth *sy;
+	Sdir d;
+	vlong next;                /* Next entry to return */
+};
+
+static uvlong
+mix(uvlong x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static uvlong
+hashname(uvlong h, char *s)
+{
+	while(*s != '\0')
+		h = (h ^ (uchar)*s++) * 0x100000001B3ULL;
+	return mix(h);
+}
+
+/* Subdirectories of a directory at depth in shape */
+static int
+nsubdirs(Synth *sy, int shape, int depth)
+{
+	int b;
+
+	if(shape == Fractal)
+		return depth == 0 ? 4 : 0;
+	if(shape == Wide)
+		return 0;
+	if(depth >= sy->depth[shape])
+		return 0;
+	switch(shape) {
+	case Sierpinski:
+		return 3;
+	case Mandelbrot:
+		b = 4 - depth / 2;
+		return b < 2 ? 2 : b;
+	case Koch:
+		return 4;
+	case Dragon:
+		return 2;
+	}
+	return 1;  /* Deep */
+}
+
+/* Files in a directory at depth in shape */
+static vlong
+nfiles(Synth *sy, int shape, int depth)
+{
+	if(shape == Fractal)
+		return 0;
+	if(shape == Wide || shape == Deep)
+		return sy->nfiles;
+	if(shape == Sierpinski)
+		return depth >= sy->depth[shape] ? 3 : 2;
+	return 1;
+}
+
+/* Entries in a tree of shape whose bottom level is at depth max,
+ * from depth down */
+static vlong
+count(Synth *sy, int shape, int depth)
+{
+	vlong n;
+
+	n = nsubdirs(sy, shape, depth);
+	if(n > 0)
+		n *= 1 + count(sy, shape, depth + 1);
+	return n + nfiles(sy, shape, depth);
+}
+
+/* Make the tree of shape as deep as brings it nearest n entries */
+static void
+fitdepth(Synth *sy, int shape, vlong n)
+{
+	vlong over, under;
+
+	under = 0;
+	for(sy->depth[shape] = 1; sy->depth[shape] < SYNTH_MAXDEPTH; sy->depth[shape]++) {
+		over = count(sy, shape, 1);
+		if(over >= n)
+			break;
+		under = over;
+	}
+	if(under > 0 && (double)n / under < (double)over / n)
+		sy->depth[shape]--;
+}
+
+/* Name and Sdir of subdirectory i of d */
+static void
+subdir(Synth *sy, Sdir *d, int i, char *name, Sdir *sub)
+{
+	*sub = *d;
+	sub->depth = d->depth + 1;
+	switch(d->shape) {
+	case Fractal:
+		sub->shape = i;
+		sub->depth = 1;
+		strecpy(name, name + NAMELEN, shapename[i]);
+		break;
+	case Sierpinski:
+		snprint(name, NAMELEN, "%c", 'a' + i);
+		sub->size = d->size / (i + 2);
+		break;
+	case Mandelbrot:
+		snprint(name, NAMELEN, "branch_%d", i + 1);
+		sub->size = d->size / (i + 2);
+		break;
+	case Koch:
+		snprint(name, NAMELEN, "seg%d", i + 1);
+		sub->size = d->size / 3;
+		break;
+	case Dragon:
+		strecpy(name, name + NAMELEN, i == 0 ? "right" : "left");
+		sub->size = d->size / 2;
+		sub->angle = (d->angle + (i == 0 ? 1 : 3)) % 4;
+		break;
+	default:
+		snprint(name, NAMELEN, "d%d", d->depth);
+		break;
+	}
+	sub->id = hashname(d->id, name);
+}
+
+/* Name and size of file i of d */
+static u64int
+file(Synth *sy, Sdir *d, vlong i, char *name)
+{
+	u64int size, noise;
+	int leaf;
+
+	leaf = nsubdirs(sy, d->shape, d->depth) == 0;
+	size = d->size;
+	switch(d->shape) {
+	case Sierpinski:
+		if(leaf) {
+			snprint(name, NAMELEN, "file%lld.dat", i + 1);
+			size = i == 0 ? size / 4 : i == 1 ? size / 2 : size;
+		} else {
+			snprint(name, NAMELEN, "data%lld.dat", i + 1);
+			size /= i == 0 ? 3 : 6;
+		}
+		break;
+	case Mandelbrot:
+		if(leaf)
+			strecpy(name, name + NAMELEN, "data.bin");
+		else
+			snprint(name, NAMELEN, "level_%d.dat", d->depth);
+		break;
+	case Koch:
+		strecpy(name, name + NAMELEN, leaf ? "endpoint.dat" : "segment.dat");
+		break;
+	case Dragon:
+		snprint(name, NAMELEN, leaf ? "endpoint_%d.dat" : "turn_%d.dat", d->angle);
+		break;
+	default:
+		snprint(name, NAMELEN, "f%lld", i);
+		size = 0;
+		break;
+	}
+
+	/* Sizes over several orders of magnitude for wide and deep */
+	noise = mix(d->id ^ sy->seed ^ i);
+	if(size == 0)
+		return (noise % 1000 + 1) << (noise >> 32) % 20;
+	return size + noise % 4096;
+}
+
+/* Follow path from the root; returns -1 if there is no such directory */
+static int
+walk(Synth *sy, char *path, Sdir *d)
+{
+	Sdir sub;
+	char name[NAMELEN], *p, *e;
+	int i, n, len;
+
+	d->shape = sy->shape;
+	d->depth = sy->shape == Fractal ? 0 : 1;
+	d->size = 1ULL << 40;
+	d->angle = 0;
+	d->id = mix(sy->seed);
+
+	for(p = path; *p != '\0'; p = e) {
+		while(*p == '/')
+			p++;
+		for(e = p; *e != '\0' && *e != '/'; e++)
+			;
+		len = e - p;
+		if(len == 0 || (len == 1 && p[0] == '.'))
+			continue;
+
+		n = nsubdirs(sy, d->shape, d->depth);
+		for(i = 0; i < n; i++) {
+			subdir(sy, d, i, name, &sub);
+			if(strlen(name) == len && memcmp(name, p, len) == 0)
+				break;
+		}
+		if(i == n) {
+			werrstr("'%s' does not exist", path);
+			return -1;
+		}
+		*d = sub;
+	}
+
+	return 0;
+}
+
+/* Fill in the Dir of a directory */
+static void
+dirof(Synth *sy, Sdir *d, Dir *dir)
+{
+	memset(dir, 0, sizeof(Dir));
+	dir->qid.path = d->id;
+	dir->qid.type = QTDIR;
+	dir->mode = DMDIR|0555;
+	dir->mtime = sy->seed;
+	dir->atime = sy->seed;
+	dir->uid = dir->gid = "synth";
+	dir->muid = "";
+}
+
+static void*
+synthopen(Source *src, char *path)
+{
+	Sopen *o;
+	Sdir d;
+
+	if(walk(src->aux, path, &d) < 0)
+		return nil;
+	o = mallocz(sizeof(Sopen), 1);
+	if(o == nil)
+		sysfatal("malloc failed: %r");
+	o->sy = src->aux;
+	o->d = d;
+
+	return o;
+}
+
+static long
+synthdirread(void *dir, Dir **dp)
+{
+	Sopen *o;
+	Synth *sy;
+	Sdir sub;
+	Dir *d;
+	char *names;
+	vlong nsub, total, i;
+	long n, k;
+
+	o = dir;
+	sy = o->sy;
+	nsub = nsubdirs(sy, o->d.shape, o->d.depth);
+	total = nsub + nfiles(sy, o->d.shape, o->d.depth);
+	n = total - o->next < SYNTH_BATCH ? total - o->next : SYNTH_BATCH;
+	if(n <= 0)
+		return 0;
+
+	/* The Dirs and their names in one allocation, as dirread */
+	d = malloc(n * (sizeof(Dir) + NAMELEN));
+	if(d == nil)
+		sysfatal("malloc failed: %r");
+	names = (char*)(d + n);
+	for(k = 0; k < n; k++) {
+		i = o->next++;
+		if(i < nsub) {
+			subdir(sy, &o->d, i, names, &sub);
+			dirof(sy, &sub, &d[k]);
+		} else {
+			memset(&d[k], 0, sizeof(Dir));
+			d[k].length = file(sy, &o->d, i - nsub, names);
+			d[k].qid.path = mix(o->d.id ^ i);
+			d[k].mode = 0444;
+			d[k].mtime = d[k].atime = sy->seed;
+			d[k].uid = d[k].gid = "synth";
+			d[k].muid = "";
+		}
+		d[k].name = names;
+		names += NAMELEN;
+	}
+
+	*dp = d;
+	return n;
+}
+
+static void
+synthclose(void *dir)
+{
+	free(dir);
+}
+
+static Dir*
+synthstat(Source *src, char *path)
+{
+	Sdir d;
+	Dir *dir;
+
+	if(walk(src->aux, path, &d) < 0)
+		return nil;
+	dir = malloc(sizeof(Dir) + NAMELEN);
+	if(dir == nil)
+		sysfatal("malloc failed: %r");
+	dirof(src->aux, &d, dir);
+	dir->name = (char*)(dir + 1);
+	strecpy(dir->name, dir->name + NAMELEN, "/");
+
+	return dir;
+}
+
+/* A source of made-up trees for spec, shape[:entries[:seed]];
+ * returns nil with the error set if spec is not one */
+Source*
+synthsource(char *spec)
+{
+	Source *src;
+	Synth *sy;
+	char *f[3], *s;
+	vlong n, levels;
+	int i, nf;
+
+	s = strdup(spec);
+	if(s == nil)
+		sysfatal("strdup failed: %r");
+	nf = getfields(s, f, nelem(f), 0, ":");
+
+	sy = mallocz(sizeof(Synth), 1);
+	if(sy == nil)
+		sysfatal("malloc failed: %r");
+	for(sy->shape = 0; sy->shape < Nshape; sy->shape++)
+		if(strcmp(f[0], shapename[sy->shape]) == 0)
+			break;
+	n = nf > 1 ? parsesize(f[1]) : SYNTH_NDEFAULT;
+	sy->seed = nf > 2 ? strtoul(f[2], nil, 0) : 1;
+	free(s);
+	if(sy->shape == Nshape || n < 1) {
+		free(sy);
+		werrstr("bad tree '%s'", spec);
+		return nil;
+	}
+	sy->n = n;
+
+	/* A deep tree gets as many levels as files on each, up to a point */
+	switch(sy->shape) {
+	case Wide:
+		sy->nfiles = n;
+		break;
+	case Deep:
+		for(levels = 1; levels < SYNTH_MAXDEEP && levels * levels < n; levels++)
+			;
+		sy->depth[Deep] = levels;
+		sy->nfiles = n / levels > 1 ? n / levels - 1 : 1;
+		break;
+	case Fractal:
+		for(i = Sierpinski; i <= Dragon; i++)
+			fitdepth(sy, i, n / 4);
+		break;
+	default:
+		fitdepth(sy, sy->shape, n);
+		break;
+	}
+
+	src = mallocz(sizeof(Source), 1);
+	if(src == nil)
+		sysfatal("malloc failed: %r");
+	src->name = shapename[sy->shape];
+	src->open = synthopen;
+	src->dirread = synthdirread;
+	src->close = synthclose;
+	src->stat = synthstat;
+	src->aux = sy;
+
+	return src;
+}
@@ -0,0 +1,181 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include "dufus.h"
+
+/*
+ * Fitting labels into rectangles. Measuring a string with
+ * stringwidth() walks the font's cache for every rune, and cutting a
+ * label down a rune at a time that way costs a pass per rune removed.
+ * Instead each rune's width is asked of the font once and kept in a
+ * table, and a label is cut in one pass that adds up widths as it
+ * goes, stopping where the space runs out.
+ *
+ * Names come out the same on every redraw, so the truncated name of a
+ * node at a given width is also kept, in a small direct-mapped cache.
+ */
+
+enum {
+	NWIDTH = 0x10000,      /* Runes with a width table entry */
+	NLABEL = 4096          /* Label cache entries (power of two) */
+};
+
+typedef struct Label Label;
+
+struct Label {
+	FsNode *node;
+	int width;
+	char *name;            /* Copy of the name the label was made from */
+	char *label;
+};
+
+static Font *widthfont;
+static short *widths;
+static int widthsonly;     /* widthfont is not a real font; see subfontwidths */
+
+static Font *labelfont;
+static Label labels[NLABEL];
+
+/* Start a width table for f, with no widths known */
+static void
+newwidths(Font *f)
+{
+	if(widths == nil) {
+		widths = malloc(NWIDTH * sizeof(short));
+		if(widths == nil)
+			sysfatal("malloc failed: %r");
+	}
+	memset(widths, 0xFF, NWIDTH * sizeof(short));
+	widthfont = f;
+	widthsonly = 0;
+}
+
+/* Width of one rune in f */
+static int
+runewidth(Font *f, Rune r)
+{
+	if(f != widthfont)
+		newwidths(f);
+
+	if(r >= NWIDTH)
+		return widthsonly ? 0 : runestringnwidth(f, &r, 1);
+	if(widths[r] < 0)
+		widths[r] = runestringnwidth(f, &r, 1);
+
+	return widths[r];
+}
+
+/* Measure in f as the subfont whose n characters are described by
+ * info, for fitting labels without a display. Until another font is
+ * measured, f only names the widths and is never itself asked;
+ * runes the subfont lacks are 0 wide. */
+void
+subfontwidths(Font *f, Fontchar *info, int n)
+{
+	Rune r;
+
+	newwidths(f);
+	for(r = 0; r < NWIDTH; r++)
+		widths[r] = r < n ? info[r].width : 0;
+	widthsonly = 1;
+}
+
+/* Width of s in f, as stringwidth() */
+int
+textwidth(Font *f, char *s)
+{
+	Rune r;
+	int w;
+
+	w = 0;
+	while(*s != '\0') {
+		s += chartorune(&r, s);
+		w += runewidth(f, r);
+	}
+
+	return w;
+}
+
+/* Truncate a string to fit the given width, adding ellipsis if needed.
+ * s must have room for the ellipsis after the last rune kept. */
+void
+truncate_string(char *s, Font *f, int max_width)
+{
+	Rune r;
+	char *p, *cut;
+	int w, ew;
+
+	if(s == nil || s[0] == '\0')
+		return;
+
+	/* cut follows the longest prefix that leaves room for the ellipsis */
+	ew = 3 * runewidth(f, '.');
+	w = 0;
+	cut = nil;
+	for(p = s; *p != '\0' && w <= max_width; ) {
+		if(w + ew <= max_width)
+			cut = p;
+		p += chartorune(&r, p);
+		w += runewidth(f, r);
+	}
+
+	if(*p == '\0' && w <= max_width)
+		return;  /* String fits, no truncation needed */
+
+	/* If we can't even fit ellipsis, just truncate to empty string */
+	if(cut == nil) {
+		s[0] = '\0';
+		return;
+	}
+	strcpy(cut, "...");
+}
+
+/* The name of node cut to fit max_width in f. The result belongs to
+ * the cache and lasts until the next call. A summary of folded
+ * entries is labelled with how many there are. */
+char*
+nodelabel(FsNode *node, Font *f, int max_width)
+{
+	Label *l;
+	uintptr h;
+	char buf[32], *name;
+	int len;
+
+	if(f != labelfont) {
+		for(l = labels; l < labels + NLABEL; l++) {
+			free(l->name);
+			free(l->label);
+			memset(l, 0, sizeof(Label));
+		}
+		labelfont = f;
+	}
+
+	name = node->name;
+	if(node->folded) {
+		snprint(buf, sizeof(buf), "(%ud entries folded)", node->vers);
+		name = buf;
+	}
+
+	h = (uintptr)node;
+	l = &labels[((h >> 4) ^ (h >> 16) ^ (max_width * 31)) & (NLABEL - 1)];
+
+	/* Nodes are freed with their trees and their memory reused, so
+	 * check the name too */
+	if(l->node == node && l->width == max_width && l->name != nil && strcmp(l->name, name) == 0)
+		return l->label;
+
+	free(l->name);
+	free(l->label);
+	len = strlen(name);
+	l->name = strdup(name);
+	l->label = malloc(len + 4);
+	if(l->name == nil || l->label == nil)
+		sysfatal("malloc failed: %r");
+	memmove(l->label, name, len + 1);
+	truncate_string(l->label, f, max_width);
+	l->node = node;
+	l->width = max_width;
+
+	return l->label;
+}
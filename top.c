@@ -0,0 +1,161 @@
+#include <u.h>
+#include <libc.h>
+#include <draw.h>
+#include <thread.h>
+#include "dufus.h"
+
+/*
+ * The largest nodes of a scan, collected while it runs. Each scanner
+ * proc offers every file, and every directory once its size is final,
+ * to heaps of its own. A heap keeps at most max entries with the
+ * smallest at the root, so an entry no bigger than that is turned away
+ * with one comparison and a bigger one takes its place in O(log max).
+ * The procs' heaps are merged when the scan is over.
+ *
+ * Entries that were folded or left below the depth limit have no
+ * node; they are kept by path instead. Callers ask topwants() first,
+ * so the path is only made for the few that get in.
+ */
+
+void
+topinit(Top *t, int max)
+{
+	t->n = 0;
+	t->max = max;
+	t->ent = nil;
+	if(max > 0) {
+		t->ent = malloc(max * sizeof(TopEnt));
+		if(t->ent == nil)
+			sysfatal("malloc failed: %r");
+	}
+}
+
+void
+topfree(Top *t)
+{
+	int i;
+
+	for(i = 0; i < t->n; i++)
+		free(t->ent[i].path);
+	free(t->ent);
+	t->ent = nil;
+	t->n = 0;
+	t->max = 0;
+}
+
+/* Move the entry at i down until neither child is smaller */
+static void
+siftdown(TopEnt *h, int n, int i)
+{
+	TopEnt x;
+	int c;
+
+	x = h[i];
+	for(;;) {
+		c = 2*i + 1;
+		if(c >= n)
+			break;
+		if(c + 1 < n && h[c+1].size < h[c].size)
+			c++;
+		if(h[c].size >= x.size)
+			break;
+		h[i] = h[c];
+		i = c;
+	}
+	h[i] = x;
+}
+
+/* Would something of size be kept? */
+int
+topwants(Top *t, u64int size)
+{
+	return t->n < t->max || (t->max > 0 && size > t->ent[0].size);
+}
+
+/* Keep e if it is among the max largest offered so far; its path is
+ * freed if not */
+static void
+topput(Top *t, TopEnt e)
+{
+	TopEnt *h;
+	int i, p;
+
+	h = t->ent;
+	if(t->n < t->max) {
+		/* Not full yet: sift up from the end */
+		for(i = t->n++; i > 0; i = p) {
+			p = (i - 1) / 2;
+			if(h[p].size <= e.size)
+				break;
+			h[i] = h[p];
+		}
+		h[i] = e;
+	} else if(t->max > 0 && e.size > h[0].size) {
+		free(h[0].path);
+		h[0] = e;
+		siftdown(h, t->n, 0);
+	} else
+		free(e.path);
+}
+
+void
+topadd(Top *t, FsNode *node)
+{
+	TopEnt e;
+
+	e.size = node->size;
+	e.node = node;
+	e.path = nil;
+	topput(t, e);
+}
+
+/* Offer something with no node by its path, which becomes the heap's */
+void
+topaddpath(Top *t, u64int size, char *path)
+{
+	TopEnt e;
+
+	e.size = size;
+	e.node = nil;
+	e.path = path;
+	topput(t, e);
+}
+
+/* Move everything in src to dst, leaving src empty */
+void
+topmerge(Top *dst, Top *src)
+{
+	int i;
+
+	for(i = 0; i < src->n; i++)
+		topput(dst, src->ent[i]);
+	src->n = 0;
+}
+
+/* Put the entries in order, largest first. The heap is used up:
+ * nothing more can be added. */
+void
+topsort(Top *t)
+{
+	TopEnt x;
+	int k;
+
+	/* Each pass moves the smallest left to the end of what remains */
+	for(k = t->n - 1; k > 0; k--) {
+		x = t->ent[0];
+		t->ent[0] = t->ent[k];
+		t->ent[k] = x;
+		siftdown(t->ent, k, 0);
+	}
+	t->max = 0;
+}
+
+/* Write the path of entry i into buf */
+void
+toppath(Top *t, int i, char *buf, int n)
+{
+	if(t->ent[i].node != nil)
+		snprint(buf, n, "%N", t->ent[i].node);
+	else
+		strecpy(buf, buf + n, t->ent[i].path);
+}